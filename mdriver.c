@@ -15,6 +15,11 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#if MM_THREADS
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
@@ -29,9 +34,12 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define MAX_THREADS   64 /* most threads the scaling benchmark (-T) runs */
+#define THREAD_REPS    3 /* runs per thread count, the fastest is reported */
+#define RING_SIZE     64 /* blocks in flight from a producer to its consumer */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
+#define IS_ALIGNED(p)  ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
 /****************************** 
  * The key compound data types 
@@ -46,9 +54,12 @@ typedef struct range_t {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
+    enum {ALLOC, FREE, REALLOC, ALLOC_BATCH, FREE_BATCH, MEMALIGN, CALLOC} type; /* type of request */
     int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc/realloc request */
+    int size;                         /* byte size of alloc/realloc request,
+                                         or of the block a free frees */
+    int count;                        /* blocks index.. of a batch request */
+    int align;                        /* alignment of a memalign request */
 } traceop_t;
 
 /* Holds the information for one trace file*/
@@ -56,6 +67,7 @@ typedef struct {
     int sugg_heapsize;   /* suggested heap size (unused) */
     int num_ids;         /* number of alloc/realloc ids */
     int num_ops;         /* number of distinct requests */
+    int num_blocks;      /* number of blocks they allocate, resize or free */
     int weight;          /* weight for this trace (unused) */
     traceop_t *ops;      /* array of requests */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
@@ -72,6 +84,23 @@ typedef struct {
     range_t *ranges;
 } speed_t;
 
+/* A block a producer hands to its consumer, with the size to free it
+   with under -s, or 0 if the trace does not tell */
+typedef struct {
+    char *block;
+    size_t size;
+} ring_entry_t;
+
+/* Holds the params of one thread of the scaling benchmark */
+typedef struct {
+    trace_t *trace;  /* trace the thread replays */
+    char **blocks;   /* the thread's own copy of the block pointers */
+    int failed;      /* set if mm_malloc or mm_realloc returned NULL */
+    ring_entry_t *ring; /* producer/consumer mode (-P): blocks to be freed ... */
+    unsigned int head, tail; /* ... by the consumer, pushed at head */
+    int done;        /* set by the producer after its last push */
+} thread_args_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
@@ -81,6 +110,16 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    size_t peak;     /* high water mark of the heap ... */
+    size_t heap;     /* ... and heap size, mapped and resident bytes at the end */
+    size_t mapped;
+    size_t resident;
+    size_t trimmed;  /* resident bytes after mm_trim (only with -m) */
+    int grows;       /* reallocs to a larger size ... */
+    int slack_grows; /* ... and those mm_usable_size says the block holds */
+    size_t slack;    /* bytes the latter grew by */
+    unsigned long fits;   /* free-block searches of the correctness run ... */
+    unsigned long probes; /* ... and the blocks they looked at */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
@@ -90,6 +129,7 @@ typedef struct {
  *******************/
 int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
+static int sized_free = 0; /* if set, free blocks with mm_free_sized (-s) */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
 /* Directory where default tracefiles are found */
@@ -121,9 +161,15 @@ static void eval_libc_speed(void *ptr);
 
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
+static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges,
+			 stats_t *stats);
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
 static void eval_mm_speed(void *ptr);
+#if MM_THREADS
+static double eval_mm_threads(trace_t *trace, int nthreads, int pairs);
+static void *eval_mm_thread(void *ptr);
+static void *eval_mm_consumer(void *ptr);
+#endif
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
@@ -150,6 +196,20 @@ int main(int argc, char **argv)
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int memory = 0;      /* If set, print heap and resident memory (-m) */
+    int slack = 0;       /* If set, print the reallocs usable sizes save (-u) */
+    int depth = 0;       /* If set, print the free-block search depth (-d) */
+    unsigned long fits, probes; /* the totals mm_fit_stats reports, unless it counts nothing */
+    int policies = 0;    /* If set, compare LIFO and address-ordered lists (-p) */
+    stats_t pstats;      /* stats of one trace under one policy */
+    double psecs[2], pops[2], putil[2];
+    int p;
+#if MM_THREADS
+    int max_threads = 0; /* If set, measure scaling up to this many threads (-T) */
+    int max_pairs = 0;   /* If set, measure up to this many producer/consumer pairs (-P) */
+    int t;
+    double kops;
+#endif
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -158,7 +218,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:T:P:H:hvVgadlmpsuG")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -178,12 +238,61 @@ int main(int argc, char **argv)
 	    if (tracedir[strlen(tracedir)-1] != '/') 
 		strcat(tracedir, "/"); /* path always ends with "/" */
 	    break;
+        case 'T': /* Measure throughput with 1 to n threads */
+#if MM_THREADS
+            max_threads = atoi(optarg);
+            if (max_threads < 1 || max_threads > MAX_THREADS) {
+                fprintf(stderr, "ERROR: -T takes 1 to %d threads\n", MAX_THREADS);
+                exit(1);
+            }
+#else
+            fprintf(stderr, "ERROR: -T needs the thread-safe driver (make mdriver-mt)\n");
+            exit(1);
+#endif
+            break;
+        case 'P': /* Measure throughput with 1 to n producer/consumer pairs */
+#if MM_THREADS
+            max_pairs = atoi(optarg);
+            if (max_pairs < 1 || 2 * max_pairs > MAX_THREADS) {
+                fprintf(stderr, "ERROR: -P takes 1 to %d pairs\n", MAX_THREADS / 2);
+                exit(1);
+            }
+#else
+            fprintf(stderr, "ERROR: -P needs the thread-safe driver (make mdriver-mt)\n");
+            exit(1);
+#endif
+            break;
+        case 'H': /* Let the simulated heap grow to this many MB */
+            if (atol(optarg) <= 0) {
+                fprintf(stderr, "ERROR: -H takes a heap size in MB\n");
+                exit(1);
+            }
+            mem_set_limit((size_t)atol(optarg) << 20);
+            break;
+        case 'G': /* Back the simulated heap with transparent huge pages */
+            mem_set_hugepages(1);
+            break;
         case 'a': /* Don't check team structure */
             team_check = 0;
             break;
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'd': /* Print the free-block search depth per trace */
+            depth = 1;
+            break;
+        case 'm': /* Print heap and resident memory per trace */
+            memory = 1;
+            break;
+        case 'p': /* Compare LIFO and address-ordered free lists */
+            policies = 1;
+            break;
+        case 's': /* Tell mm_free_sized the size of every freed block */
+            sized_free = 1;
+            break;
+        case 'u': /* Print the reallocs that usable sizes make unnecessary */
+            slack = 1;
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -253,7 +362,7 @@ int main(int argc, char **argv)
 	/* Evaluate the libc malloc package using the K-best scheme */
 	for (i=0; i < num_tracefiles; i++) {
 	    trace = read_trace(tracedir, tracefiles[i]);
-	    libc_stats[i].ops = trace->num_ops;
+	    libc_stats[i].ops = trace->num_blocks;
 	    if (verbose > 1)
 		printf("Checking libc malloc for correctness, ");
 	    libc_stats[i].valid = eval_libc_valid(trace, i);
@@ -290,14 +399,23 @@ int main(int argc, char **argv)
     /* Evaluate student's mm malloc package using the K-best scheme */
     for (i=0; i < num_tracefiles; i++) {
 	trace = read_trace(tracedir, tracefiles[i]);
-	mm_stats[i].ops = trace->num_ops;
+	mm_stats[i].ops = trace->num_blocks;
 	if (verbose > 1)
 	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
+	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges, &mm_stats[i]);
+	mm_fit_stats(&mm_stats[i].fits, &mm_stats[i].probes);
 	if (mm_stats[i].valid) {
 	    if (verbose > 1)
 		printf("efficiency, ");
 	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+	    mm_stats[i].peak = mem_heap_peak();
+	    mm_stats[i].heap = mem_heapsize();
+	    mm_stats[i].mapped = mem_mapsize();
+	    mm_stats[i].resident = mem_resident();
+	    if (memory) {
+		mm_trim();
+		mm_stats[i].trimmed = mem_resident();
+	    }
 	    speed_params.trace = trace;
 	    speed_params.ranges = ranges;
 	    if (verbose > 1)
@@ -314,6 +432,143 @@ int main(int argc, char **argv)
 	printf("\n");
     }
 
+    /* Optionally show what the heap of every trace costs in memory */
+    if (memory) {
+	printf("Memory for mm malloc (KB, at the end of each trace):\n");
+	printf("%5s%10s%10s%10s%10s%10s\n", "trace", "peak", "heap", "mapped",
+	       "resident", "trimmed");
+	for (i=0; i < num_tracefiles; i++)
+	    if (mm_stats[i].valid)
+		printf("%2d   %10zu%10zu%10zu%10zu%10zu\n", i, mm_stats[i].peak / 1024,
+		       mm_stats[i].heap / 1024, mm_stats[i].mapped / 1024,
+		       mm_stats[i].resident / 1024, mm_stats[i].trimmed / 1024);
+	printf("\n");
+    }
+
+    /* Optionally show how many growing reallocs a caller that checks
+       mm_usable_size first could have skipped */
+    if (slack) {
+	printf("Realloc slack for mm malloc (grows that fit the usable size):\n");
+	printf("%5s%10s%10s%8s%10s\n", "trace", "grows", "in slack", "%", "KB");
+	for (i=0; i < num_tracefiles; i++)
+	    if (mm_stats[i].valid)
+		printf("%2d   %10d%10d%7.0f%%%10zu\n", i, mm_stats[i].grows,
+		       mm_stats[i].slack_grows,
+		       mm_stats[i].grows ? 100.0 * mm_stats[i].slack_grows / mm_stats[i].grows : 0.0,
+		       mm_stats[i].slack / 1024);
+	printf("\n");
+    }
+
+    /* Optionally show how far find_fit searches, next to the throughput
+       it leads to */
+    if (depth && mm_fit_stats(&fits, &probes) < 0) {
+	printf("Free-block search depth for mm malloc: not counted, build mm.c\n"
+	       "with -DFIT_STATS=1 (as mdriver-classes is)\n\n");
+    } else if (depth) {
+	printf("Free-block search depth for mm malloc:\n");
+	printf("%5s%10s%10s%8s%10s\n", "trace", "searches", "probes", "depth", "Kops");
+	for (i=0; i < num_tracefiles; i++)
+	    if (mm_stats[i].valid)
+		printf("%2d   %10lu%10lu%8.2f%10.0f\n", i, mm_stats[i].fits,
+		       mm_stats[i].probes,
+		       mm_stats[i].fits ? (double) mm_stats[i].probes / mm_stats[i].fits : 0.0,
+		       mm_stats[i].ops / mm_stats[i].secs / 1e3);
+	printf("\n");
+    }
+
+#if MM_THREADS
+    /*
+     * Optionally replay every trace in 1 to max_threads threads at once,
+     * each thread with its own blocks, and report the total throughput
+     */
+    if (max_threads > 0) {
+	printf("Thread scaling for mm malloc (Kops):\n");
+	printf("trace");
+	for (t = 1; t <= max_threads; t++)
+	    printf("%9d", t);
+	printf("\n");
+	for (i=0; i < num_tracefiles; i++) {
+	    trace = read_trace(tracedir, tracefiles[i]);
+	    printf("%2d   ", i);
+	    for (t = 1; t <= max_threads; t++) {
+		kops = eval_mm_threads(trace, t, 0);
+		if (kops < 0)
+		    printf("%9s", "no mem");
+		else
+		    printf("%9.0f", kops);
+	    }
+	    printf("\n");
+	    free_trace(trace);
+	}
+	printf("\n");
+    }
+
+    /*
+     * Optionally replay every trace in 1 to max_pairs pairs of threads,
+     * where the producer frees nothing itself and hands its blocks to
+     * the consumer, which frees them
+     */
+    if (max_pairs > 0) {
+	printf("Producer/consumer pairs for mm malloc (Kops):\n");
+	printf("trace");
+	for (t = 1; t <= max_pairs; t++)
+	    printf("%9d", t);
+	printf("\n");
+	for (i=0; i < num_tracefiles; i++) {
+	    trace = read_trace(tracedir, tracefiles[i]);
+	    printf("%2d   ", i);
+	    for (t = 1; t <= max_pairs; t++) {
+		kops = eval_mm_threads(trace, t, 1);
+		if (kops < 0)
+		    printf("%9s", "no mem");
+		else
+		    printf("%9.0f", kops);
+	    }
+	    printf("\n");
+	    free_trace(trace);
+	}
+	printf("\n");
+    }
+#endif
+
+    /*
+     * Optionally replay every trace with LIFO and with address-ordered
+     * free lists, and show utilization and throughput side by side
+     */
+    if (policies) {
+	printf("Free-list policy for mm malloc:\n");
+	printf("%5s%10s%10s%10s%10s\n", "trace", "LIFO", "Kops", "address", "Kops");
+	for (p = MM_LIFO; p <= MM_ADDRESS_ORDER; p++)
+	    psecs[p] = pops[p] = putil[p] = 0;
+	for (i=0; i < num_tracefiles; i++) {
+	    trace = read_trace(tracedir, tracefiles[i]);
+	    printf("%2d   ", i);
+	    for (p = MM_LIFO; p <= MM_ADDRESS_ORDER; p++) {
+		mm_set_policy(p);
+		memset(&pstats, 0, sizeof(pstats));
+		if (!eval_mm_valid(trace, i, &ranges, &pstats)) {
+		    printf("%20s", "invalid");
+		    continue;
+		}
+		util = eval_mm_util(trace, i, &ranges);
+		speed_params.trace = trace;
+		speed_params.ranges = ranges;
+		secs = fsecs(eval_mm_speed, &speed_params);
+		printf("%9.1f%%%10.0f", util * 100.0, trace->num_blocks / secs / 1e3);
+		putil[p] += util;
+		pops[p] += trace->num_blocks;
+		psecs[p] += secs;
+	    }
+	    printf("\n");
+	    free_trace(trace);
+	}
+	printf("%5s", "Total");
+	for (p = MM_LIFO; p <= MM_ADDRESS_ORDER; p++)
+	    printf("%9.1f%%%10.0f", putil[p] * 100.0 / num_tracefiles,
+		   psecs[p] > 0 ? pops[p] / psecs[p] / 1e3 : 0.0);
+	printf("\n\n");
+    }
+
     /* 
      * Accumulate the aggregate statistics for the student's mm package 
      */
@@ -413,9 +668,11 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or within
+       one of the mappings the package made with mem_map */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+	 (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+	!mem_in_map(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
@@ -495,7 +752,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
     trace_t *trace;
     char type[MAXLINE];
     char path[MAXLINE];
-    unsigned index, size;
+    unsigned index, size, count, align, i;
     unsigned max_index = 0;
     unsigned op_index;
 
@@ -533,9 +790,11 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
 	unix_error("malloc 4 failed in read_trace");
     
-    /* read every request line in the trace file */
+    /* read every request line in the trace file, keeping the size of
+       every block in block_sizes so that a free knows what it frees */
     index = 0;
     op_index = 0;
+    trace->num_blocks = 0;
     while (fscanf(tracefile, "%s", type) != EOF) {
 	switch(type[0]) {
 	case 'a':
@@ -543,6 +802,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	    trace->ops[op_index].type = ALLOC;
 	    trace->ops[op_index].index = index;
 	    trace->ops[op_index].size = size;
+	    trace->block_sizes[index] = size;
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
 	case 'r':
@@ -550,18 +810,59 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	    trace->ops[op_index].type = REALLOC;
 	    trace->ops[op_index].index = index;
 	    trace->ops[op_index].size = size;
+	    trace->block_sizes[index] = size;
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
 	case 'f':
 	    fscanf(tracefile, "%ud", &index);
 	    trace->ops[op_index].type = FREE;
 	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = trace->block_sizes[index];
+	    break;
+	case 'c': /* c <index> <size> */
+	    fscanf(tracefile, "%u %u", &index, &size);
+	    trace->ops[op_index].type = CALLOC;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    trace->block_sizes[index] = size;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case 'm': /* m <index> <align> <size> */
+	    fscanf(tracefile, "%u %u %u", &index, &align, &size);
+	    trace->ops[op_index].type = MEMALIGN;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].align = align;
+	    trace->ops[op_index].size = size;
+	    trace->block_sizes[index] = size;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case 'A': /* A <index> <count> <size>: count blocks at index.. */
+	    fscanf(tracefile, "%u %u %u", &index, &count, &size);
+	    trace->ops[op_index].type = ALLOC_BATCH;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].count = count;
+	    trace->ops[op_index].size = size;
+	    for (i = 0; i < count; i++)
+		trace->block_sizes[index + i] = size;
+	    index += count - 1;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case 'F': /* F <index> <count> */
+	    fscanf(tracefile, "%u %u", &index, &count);
+	    trace->ops[op_index].type = FREE_BATCH;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].count = count;
 	    break;
 	default:
 	    printf("Bogus type character (%c) in tracefile %s\n", 
 		   type[0], path);
 	    exit(1);
 	}
+	if (trace->ops[op_index].type == ALLOC_BATCH ||
+	    trace->ops[op_index].type == FREE_BATCH)
+	    trace->num_blocks += trace->ops[op_index].count;
+	else
+	    trace->num_blocks++;
 	op_index++;
 	
     }
@@ -592,11 +893,13 @@ void free_trace(trace_t *trace)
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) 
+static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges,
+			 stats_t *stats)
 {
     int i, j;
     int index;
     int size;
+    int count;
     int oldsize;
     char *newp;
     char *oldp;
@@ -634,6 +937,12 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	     */ 
 	    if (add_range(ranges, p, size, tracenum, i) == 0)
 		return 0;
+
+	    /* The block holds at least what mm_good_size promised */
+	    if (mm_good_size(size) < size || mm_usable_size(p) < mm_good_size(size)) {
+		malloc_error(tracenum, i, "mm_usable_size is smaller than mm_good_size.");
+		return 0;
+	    }
 	    
 	    /* ADDED: cgw
 	     * fill range with low byte of index.  This will be used later
@@ -649,8 +958,18 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 
         case REALLOC: /* mm_realloc */
 	    
-	    /* Call the student's realloc */
+	    /* A caller that checks mm_usable_size first would not have
+	       called mm_realloc to grow into the slack of the block */
 	    oldp = trace->blocks[index];
+	    if (size > trace->block_sizes[index]) {
+		stats->grows++;
+		if (size <= mm_usable_size(oldp)) {
+		    stats->slack_grows++;
+		    stats->slack += size - trace->block_sizes[index];
+		}
+	    }
+
+	    /* Call the student's realloc */
 	    if ((newp = mm_realloc(oldp, size)) == NULL) {
 		malloc_error(tracenum, i, "mm_realloc failed.");
 		return 0;
@@ -662,6 +981,10 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    /* Check new block for correctness and add it to range list */
 	    if (add_range(ranges, newp, size, tracenum, i) == 0)
 		return 0;
+	    if (mm_usable_size(newp) < size) {
+		malloc_error(tracenum, i, "mm_usable_size is smaller than the request.");
+		return 0;
+	    }
 	    
 	    /* ADDED: cgw
 	     * Make sure that the new block contains the data from the old 
@@ -671,7 +994,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
 	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	      if ((unsigned char) newp[j] != (index & 0xFF)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
@@ -689,7 +1012,74 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    /* Remove region from list and call student's free function */
 	    p = trace->blocks[index];
 	    remove_range(ranges, p);
-	    mm_free(p);
+	    if (sized_free)
+		mm_free_sized(p, size);
+	    else
+		mm_free(p);
+	    break;
+
+        case CALLOC: /* mm_calloc */
+
+	    /* Checked like mm_malloc, and for a cleared payload */
+	    if ((p = mm_calloc(1, size)) == NULL) {
+		malloc_error(tracenum, i, "mm_calloc failed.");
+		return 0;
+	    }
+	    if (add_range(ranges, p, size, tracenum, i) == 0)
+		return 0;
+	    for (j = 0; j < size; j++) {
+		if (p[j] != 0) {
+		    malloc_error(tracenum, i, "mm_calloc did not clear the block");
+		    return 0;
+		}
+	    }
+	    memset(p, index & 0xFF, size);
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    break;
+
+        case MEMALIGN: /* mm_memalign */
+
+	    /* Checked like mm_malloc, and for the requested alignment */
+	    if ((p = mm_memalign(trace->ops[i].align, size)) == NULL) {
+		malloc_error(tracenum, i, "mm_memalign failed.");
+		return 0;
+	    }
+	    if ((unsigned long)p % trace->ops[i].align != 0) {
+		malloc_error(tracenum, i, "mm_memalign returned a misaligned payload.");
+		return 0;
+	    }
+	    if (add_range(ranges, p, size, tracenum, i) == 0)
+		return 0;
+	    memset(p, index & 0xFF, size);
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    break;
+
+        case ALLOC_BATCH: /* mm_malloc_batch */
+
+	    /* Every block of the batch is checked like a single one */
+	    count = trace->ops[i].count;
+	    if (mm_malloc_batch(size, count, (void **)&trace->blocks[index]) != count) {
+		malloc_error(tracenum, i, "mm_malloc_batch failed.");
+		return 0;
+	    }
+	    for (j = 0; j < count; j++) {
+		p = trace->blocks[index + j];
+		if (add_range(ranges, p, size, tracenum, i) == 0)
+		    return 0;
+		memset(p, (index + j) & 0xFF, size);
+		trace->block_sizes[index + j] = size;
+	    }
+	    break;
+
+        case FREE_BATCH: /* mm_free_batch */
+
+	    /* mm_free_batch reorders the pointers, which are dead after it */
+	    count = trace->ops[i].count;
+	    for (j = 0; j < count; j++)
+		remove_range(ranges, trace->blocks[index + j]);
+	    mm_free_batch((void **)&trace->blocks[index], count);
 	    break;
 
 	default:
@@ -707,23 +1097,25 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   high water mark of the heap in bytes while running the student's
+ *   malloc package on the trace, counting the mappings it made with
+ *   mem_map as part of the heap. mem_sbrk() lets the package decrement
+ *   the brk pointer, so the final heap size may be smaller than that.
  *   
  */
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 {   
-    int i;
+    int i, j;
     int index;
-    int size, newsize, oldsize;
+    int size, newsize, oldsize, count;
     int max_total_size = 0;
     int total_size = 0;
     char *p;
     char *newp, *oldp;
 
-    /* initialize the heap and the mm malloc package */
+    /* initialize the heap and the mm malloc package, starting with no
+       resident pages so that mem_resident() only counts this trace */
+    mem_release(mem_heap_lo(), (char *)mem_heap_hi() + 1 - (char *)mem_heap_lo());
     mem_reset_brk();
     if (mm_init() < 0)
 	app_error("mm_init failed in eval_mm_util");
@@ -778,7 +1170,10 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    size = trace->block_sizes[index];
 	    p = trace->blocks[index];
 	    
-	    mm_free(p);
+	    if (sized_free)
+		mm_free_sized(p, size);
+	    else
+		mm_free(p);
 	    
 	    /* Keep track of current total size
 	     * of all allocated blocks */
@@ -786,13 +1181,55 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    break;
 
+        case CALLOC: /* mm_calloc */
+        case MEMALIGN: /* mm_memalign */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+
+	    if (trace->ops[i].type == CALLOC)
+		p = mm_calloc(1, size);
+	    else
+		p = mm_memalign(trace->ops[i].align, size);
+	    if (p == NULL)
+		app_error("mm_calloc or mm_memalign failed in eval_mm_util");
+
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    total_size += size;
+	    max_total_size = (total_size > max_total_size) ?
+		total_size : max_total_size;
+	    break;
+
+        case ALLOC_BATCH: /* mm_malloc_batch */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    count = trace->ops[i].count;
+
+	    if (mm_malloc_batch(size, count, (void **)&trace->blocks[index]) != count)
+		app_error("mm_malloc_batch failed in eval_mm_util");
+
+	    for (j = 0; j < count; j++)
+		trace->block_sizes[index + j] = size;
+	    total_size += count * size;
+	    max_total_size = (total_size > max_total_size) ?
+		total_size : max_total_size;
+	    break;
+
+        case FREE_BATCH: /* mm_free_batch */
+	    index = trace->ops[i].index;
+	    count = trace->ops[i].count;
+	    for (j = 0; j < count; j++)
+		total_size -= trace->block_sizes[index + j];
+	    mm_free_batch((void **)&trace->blocks[index], count);
+	    break;
+
 	default:
 	    app_error("Nonexistent request type in eval_mm_util");
 
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)mem_heap_peak());
 }
 
 
@@ -835,7 +1272,36 @@ static void eval_mm_speed(void *ptr)
         case FREE: /* mm_free */
             index = trace->ops[i].index;
             block = trace->blocks[index];
-            mm_free(block);
+            if (sized_free)
+                mm_free_sized(block, trace->ops[i].size);
+            else
+                mm_free(block);
+            break;
+
+        case CALLOC: /* mm_calloc */
+            index = trace->ops[i].index;
+            if ((p = mm_calloc(1, trace->ops[i].size)) == NULL)
+		app_error("mm_calloc error in eval_mm_speed");
+            trace->blocks[index] = p;
+            break;
+
+        case MEMALIGN: /* mm_memalign */
+            index = trace->ops[i].index;
+            if ((p = mm_memalign(trace->ops[i].align, trace->ops[i].size)) == NULL)
+		app_error("mm_memalign error in eval_mm_speed");
+            trace->blocks[index] = p;
+            break;
+
+        case ALLOC_BATCH: /* mm_malloc_batch */
+            index = trace->ops[i].index;
+            if (mm_malloc_batch(trace->ops[i].size, trace->ops[i].count,
+                                (void **)&trace->blocks[index]) != trace->ops[i].count)
+		app_error("mm_malloc_batch error in eval_mm_speed");
+            break;
+
+        case FREE_BATCH: /* mm_free_batch */
+            index = trace->ops[i].index;
+            mm_free_batch((void **)&trace->blocks[index], trace->ops[i].count);
             break;
 
 	default:
@@ -843,6 +1309,176 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+#if MM_THREADS
+/*
+ * eval_mm_threads - Replay a trace in nthreads threads at once on one
+ *    heap and return the best total throughput in Kops, or -1 if the
+ *    heap ran out of memory. With pairs set, every thread is paired with
+ *    a consumer thread that frees the blocks the trace frees.
+ */
+static double eval_mm_threads(trace_t *trace, int nthreads, int pairs)
+{
+    pthread_t tids[MAX_THREADS], ctids[MAX_THREADS];
+    thread_args_t args[MAX_THREADS];
+    struct timeval start, end;
+    double secs, best = DBL_MAX;
+    int rep, t, failed = 0;
+
+    for (t = 0; t < nthreads; t++) {
+	args[t].trace = trace;
+	args[t].ring = NULL;
+	if ((args[t].blocks = calloc(trace->num_ids, sizeof(char *))) == NULL)
+	    unix_error("calloc failed in eval_mm_threads");
+	if (pairs && (args[t].ring = calloc(RING_SIZE, sizeof(ring_entry_t))) == NULL)
+	    unix_error("calloc failed in eval_mm_threads");
+    }
+
+    for (rep = 0; rep < THREAD_REPS && !failed; rep++) {
+	mem_reset_brk();
+	if (mm_init() < 0)
+	    app_error("mm_init failed in eval_mm_threads");
+
+	gettimeofday(&start, NULL);
+	for (t = 0; t < nthreads; t++) {
+	    args[t].failed = 0;
+	    args[t].head = args[t].tail = 0;
+	    args[t].done = 0;
+	    if (pthread_create(&tids[t], NULL, eval_mm_thread, &args[t]) != 0)
+		unix_error("pthread_create failed in eval_mm_threads");
+	    if (pairs && pthread_create(&ctids[t], NULL, eval_mm_consumer, &args[t]) != 0)
+		unix_error("pthread_create failed in eval_mm_threads");
+	}
+	for (t = 0; t < nthreads; t++) {
+	    pthread_join(tids[t], NULL);
+	    if (pairs)
+		pthread_join(ctids[t], NULL);
+	    failed |= args[t].failed;
+	}
+	gettimeofday(&end, NULL);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+	if (secs < best)
+	    best = secs;
+    }
+
+    for (t = 0; t < nthreads; t++) {
+	free(args[t].blocks);
+	free(args[t].ring);
+    }
+    if (failed)
+	return -1;
+    return (double) nthreads * trace->num_blocks / best / 1e3;
+}
+
+/*
+ * eval_mm_thread - One thread of eval_mm_threads: interpret each
+ *    trace request with the thread's own block pointers. In a pair,
+ *    blocks to be freed are pushed to the consumer's ring instead.
+ */
+static void *eval_mm_thread(void *ptr)
+{
+    thread_args_t *args = (thread_args_t *)ptr;
+    trace_t *trace = args->trace;
+    char **blocks = args->blocks;
+    int i, j, index, count;
+    unsigned int head = 0;
+
+    for (i = 0;  i < trace->num_ops && !args->failed;  i++) {
+	index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+            if ((blocks[index] = mm_malloc(trace->ops[i].size)) == NULL)
+		args->failed = 1;
+            break;
+
+	case REALLOC: /* mm_realloc */
+            if ((blocks[index] = mm_realloc(blocks[index], trace->ops[i].size)) == NULL)
+		args->failed = 1;
+            break;
+
+        case FREE: /* mm_free */
+	    if (args->ring == NULL) {
+		if (sized_free)
+		    mm_free_sized(blocks[index], trace->ops[i].size);
+		else
+		    mm_free(blocks[index]);
+		break;
+	    }
+	    while (head - __atomic_load_n(&args->tail, __ATOMIC_ACQUIRE) == RING_SIZE)
+		sched_yield();
+	    args->ring[head % RING_SIZE].block = blocks[index];
+	    args->ring[head % RING_SIZE].size = trace->ops[i].size;
+	    __atomic_store_n(&args->head, ++head, __ATOMIC_RELEASE);
+            break;
+
+        case CALLOC: /* mm_calloc */
+            if ((blocks[index] = mm_calloc(1, trace->ops[i].size)) == NULL)
+		args->failed = 1;
+            break;
+
+        case MEMALIGN: /* mm_memalign */
+            if ((blocks[index] = mm_memalign(trace->ops[i].align, trace->ops[i].size)) == NULL)
+		args->failed = 1;
+            break;
+
+        case ALLOC_BATCH: /* mm_malloc_batch */
+	    count = trace->ops[i].count;
+            if (mm_malloc_batch(trace->ops[i].size, count, (void **)&blocks[index]) != count)
+		args->failed = 1;
+            break;
+
+        case FREE_BATCH: /* mm_free_batch, or one push per block */
+	    count = trace->ops[i].count;
+	    if (args->ring == NULL) {
+		mm_free_batch((void **)&blocks[index], count);
+		break;
+	    }
+	    for (j = 0; j < count; j++) {
+		while (head - __atomic_load_n(&args->tail, __ATOMIC_ACQUIRE) == RING_SIZE)
+		    sched_yield();
+		args->ring[head % RING_SIZE].block = blocks[index + j];
+		args->ring[head % RING_SIZE].size = 0;
+		__atomic_store_n(&args->head, ++head, __ATOMIC_RELEASE);
+	    }
+            break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_thread");
+        }
+    }
+    __atomic_store_n(&args->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+ * eval_mm_consumer - The consumer of a pair in eval_mm_threads: free
+ *    every block its producer pushes until the producer is done, with
+ *    mm_free_sized under -s.
+ */
+static void *eval_mm_consumer(void *ptr)
+{
+    thread_args_t *args = (thread_args_t *)ptr;
+    unsigned int tail = 0;
+    int done;
+
+    for (;;) {
+	done = __atomic_load_n(&args->done, __ATOMIC_ACQUIRE);
+	if (tail == __atomic_load_n(&args->head, __ATOMIC_ACQUIRE)) {
+	    if (done)
+		return NULL;
+	    sched_yield();
+	    continue;
+	}
+	if (sized_free)
+	    mm_free_sized(args->ring[tail % RING_SIZE].block, args->ring[tail % RING_SIZE].size);
+	else
+	    mm_free(args->ring[tail % RING_SIZE].block);
+	__atomic_store_n(&args->tail, ++tail, __ATOMIC_RELEASE);
+    }
+}
+#endif
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -851,7 +1487,7 @@ static void eval_mm_speed(void *ptr)
  */
 static int eval_libc_valid(trace_t *trace, int tracenum)
 {
-    int i, newsize;
+    int i, j, newsize;
     char *p, *newp, *oldp;
 
     for (i = 0;  i < trace->num_ops;  i++) {
@@ -879,6 +1515,37 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 	    free(trace->blocks[trace->ops[i].index]);
 	    break;
 
+        case CALLOC: /* calloc */
+	    if ((p = calloc(1, trace->ops[i].size)) == NULL) {
+		malloc_error(tracenum, i, "libc calloc failed");
+		unix_error("System message");
+	    }
+	    trace->blocks[trace->ops[i].index] = p;
+	    break;
+
+        case MEMALIGN: /* posix_memalign */
+	    if (posix_memalign((void **)&p, trace->ops[i].align, trace->ops[i].size) != 0) {
+		malloc_error(tracenum, i, "libc posix_memalign failed");
+		unix_error("System message");
+	    }
+	    trace->blocks[trace->ops[i].index] = p;
+	    break;
+
+        case ALLOC_BATCH: /* one malloc per block */
+	    for (j = 0; j < trace->ops[i].count; j++) {
+		if ((p = malloc(trace->ops[i].size)) == NULL) {
+		    malloc_error(tracenum, i, "libc malloc failed");
+		    unix_error("System message");
+		}
+		trace->blocks[trace->ops[i].index + j] = p;
+	    }
+	    break;
+
+        case FREE_BATCH: /* one free per block */
+	    for (j = 0; j < trace->ops[i].count; j++)
+		free(trace->blocks[trace->ops[i].index + j]);
+	    break;
+
 	default:
 	    app_error("invalid operation type  in eval_libc_valid");
 	}
@@ -894,7 +1561,7 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
  */
 static void eval_libc_speed(void *ptr)
 {
-    int i;
+    int i, j;
     int index, size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
@@ -924,6 +1591,35 @@ static void eval_libc_speed(void *ptr)
 	    block = trace->blocks[index];
 	    free(block);
 	    break;
+
+        case CALLOC: /* calloc */
+	    index = trace->ops[i].index;
+	    if ((p = calloc(1, trace->ops[i].size)) == NULL)
+		unix_error("calloc failed in eval_libc_speed");
+	    trace->blocks[index] = p;
+	    break;
+
+        case MEMALIGN: /* posix_memalign */
+	    index = trace->ops[i].index;
+	    if (posix_memalign((void **)&p, trace->ops[i].align, trace->ops[i].size) != 0)
+		unix_error("posix_memalign failed in eval_libc_speed");
+	    trace->blocks[index] = p;
+	    break;
+
+        case ALLOC_BATCH: /* one malloc per block */
+	    index = trace->ops[i].index;
+	    for (j = 0; j < trace->ops[i].count; j++) {
+		if ((p = malloc(trace->ops[i].size)) == NULL)
+		    unix_error("malloc failed in eval_libc_speed");
+		trace->blocks[index + j] = p;
+	    }
+	    break;
+
+        case FREE_BATCH: /* one free per block */
+	    index = trace->ops[i].index;
+	    for (j = 0; j < trace->ops[i].count; j++)
+		free(trace->blocks[index + j]);
+	    break;
 	}
     }
 }
@@ -1022,14 +1718,23 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvVadlmpsuG] [-f <file>] [-t <dir>] [-H <mb>] [-T <n>] [-P <n>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
+    fprintf(stderr, "\t-d         Print the free-block search depth per trace.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
+    fprintf(stderr, "\t-G         Back the heap with transparent huge pages.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H <mb>    Let the heap grow to <mb> MB (default MEM_HEAP_MB or config.h).\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-m         Print heap and resident memory per trace.\n");
+    fprintf(stderr, "\t-s         Free with mm_free_sized instead of mm_free.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-u         Print the reallocs mm_usable_size makes unnecessary.\n");
+    fprintf(stderr, "\t-T <n>     Measure throughput with 1 to n threads (mdriver-mt).\n");
+    fprintf(stderr, "\t-p         Compare LIFO and address-ordered free lists.\n");
+    fprintf(stderr, "\t-P <n>     Same with 1 to n producer/consumer pairs (mdriver-mt).\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
 }
@@ -2,7 +2,29 @@
  * memlib.c - a module that simulates the memory system.  Needed because it 
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
+ *
+ *            The simulated memory holds MEM_REGIONS regions, each with its
+ *            own brk. Every region may grow up to a limit of MAX_HEAP bytes,
+ *            or what mem_set_limit or the MEM_HEAP_MB environment variable
+ *            ask for, and region i starts i * mem_region_span() bytes after
+ *            region 0. The classic heap interface (mem_sbrk, mem_heap_lo,
+ *            ...) works on region 0, except that mem_heap_hi and
+ *            mem_heapsize cover every region.
+ *
+ *            The regions are a single mmap reservation with no access
+ *            rights. Memory is only committed, in steps of MEM_COMMIT
+ *            bytes, as a brk advances, so a large limit costs nothing up
+ *            front. With mem_set_hugepages or MEM_HUGEPAGES=1 the regions
+ *            are backed by transparent huge pages where the kernel can.
+ *
+ *            A region can also shrink, and pages of the model can be given
+ *            back to the system with mem_release, so mem_resident shows
+ *            how much of the heap actually occupies physical memory.
+ *            Each region remembers how far up it has ever held data, and
+ *            mem_region_zero tells a caller from where on it still reads
+ *            as zero.
  */
+#define _GNU_SOURCE /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -10,28 +32,94 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
 
 #include "memlib.h"
 #include "config.h"
 
+/* regions are committed, and aligned, in steps of this many bytes */
+#define MEM_COMMIT (1 << 21)
+
 /* private variables */
+static char *mem_reserve;    /* the reservation, as returned by mmap */
+static size_t mem_reserve_size;
 static char *mem_start_brk;  /* points to first byte of heap */
-static char *mem_brk;        /* points to last byte of heap */
-static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_brk[MEM_REGIONS]; /* points to last byte of each region */
+static char *mem_commit[MEM_REGIONS]; /* end of the committed part of each region */
+static char *mem_dirty[MEM_REGIONS]; /* each region reads as zero from here on */
+static size_t mem_limit;     /* most bytes a region may hold, 0 until set */
+static size_t mem_span;      /* distance between regions, a power of two */
+static int mem_hugepages = -1; /* use transparent huge pages, -1 until set */
+
+/* mappings made by mem_map, guarded by a spin lock */
+typedef struct {
+    char *addr;
+    size_t len;
+} mem_mapping_t;
+static mem_mapping_t *mem_maps;
+static int mem_nmaps, mem_maxmaps;
+static size_t mem_mapped;    /* bytes in all mappings */
+static int mem_maps_lock;
+
+static size_t mem_total;     /* bytes in the regions and mappings ... */
+static size_t mem_peak;      /* ... and its largest value so far */
+
+static void mem_account(long incr);
+static void mem_unmap_all(void);
+
+/*
+ * mem_set_limit - set the most bytes a region may hold; takes effect at
+ *    the next mem_init
+ */
+void mem_set_limit(size_t limit)
+{
+    mem_limit = limit;
+}
+
+/*
+ * mem_set_hugepages - ask for transparent huge pages (or not); takes
+ *    effect at the next mem_init
+ */
+void mem_set_hugepages(int on)
+{
+    mem_hugepages = on;
+}
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    char *env;
+    int i;
+
+    /* settings not made by the caller come from the environment */
+    if (mem_limit == 0 && (env = getenv("MEM_HEAP_MB")) != NULL)
+	mem_limit = (size_t)atol(env) << 20;
+    if (mem_limit == 0)
+	mem_limit = MAX_HEAP;
+    if (mem_hugepages < 0)
+	mem_hugepages = (env = getenv("MEM_HUGEPAGES")) != NULL && atoi(env);
+    for (mem_span = MEM_COMMIT; mem_span < mem_limit; mem_span <<= 1)
+	;
+
+    /* reserve the address space we will use to model the available VM,
+       with room to align it to MEM_COMMIT */
+    mem_reserve_size = MEM_REGIONS * mem_span + MEM_COMMIT;
+    mem_reserve = mmap(NULL, mem_reserve_size, PROT_NONE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem_reserve == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
 	exit(1);
     }
+    mem_start_brk = (char *)(((uintptr_t)mem_reserve + MEM_COMMIT - 1) & ~(uintptr_t)(MEM_COMMIT - 1));
+#ifdef MADV_HUGEPAGE
+    if (mem_hugepages)
+	madvise(mem_start_brk, MEM_REGIONS * mem_span, MADV_HUGEPAGE);
+#endif
 
-    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
-    mem_brk = mem_start_brk;                  /* heap is empty initially */
+    for (i = 0; i < MEM_REGIONS; i++)
+	mem_brk[i] = mem_commit[i] = mem_dirty[i] = mem_region_lo(i); /* regions are empty initially */
 }
 
 /* 
@@ -39,35 +127,281 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    mem_unmap_all();
+    free(mem_maps);
+    mem_maps = NULL;
+    mem_nmaps = mem_maxmaps = 0;
+    munmap(mem_reserve, mem_reserve_size);
+    mem_reserve = NULL;
+    mem_reserve_size = 0;
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointers to make empty regions;
+ *    the memory they held is not cleared
  */
 void mem_reset_brk()
 {
-    mem_brk = mem_start_brk;
+    int i;
+
+    for (i = 0; i < MEM_REGIONS; i++)
+	mem_brk[i] = mem_region_lo(i);
+    mem_unmap_all();
+    mem_total = mem_peak = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    (region 0) by incr bytes and returns the start address of the new
+ *    area. A negative incr shrinks the heap and releases the pages
+ *    above the new brk.
  */
 void *mem_sbrk(int incr) 
 {
-    char *old_brk = mem_brk;
+    return mem_region_sbrk(0, incr);
+}
+
+/*
+ * mem_region_sbrk - extends (or shrinks) region by incr bytes and returns
+ *    the old brk of the region, like mem_sbrk does for the heap
+ */
+void *mem_region_sbrk(int region, long incr)
+{
+    char *old_brk = mem_brk[region];
+    char *commit;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if ((old_brk + incr) < (char *)mem_region_lo(region)) {
+	errno = EINVAL;
+	fprintf(stderr, "ERROR: mem_sbrk failed. Shrinking below the region...\n");
+	return (void *)-1;
+    }
+    if ((old_brk + incr) > (char *)mem_region_lo(region) + mem_limit) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
-    mem_brk += incr;
+
+    /* commit the reservation up to the next MEM_COMMIT boundary */
+    if (old_brk + incr > mem_commit[region]) {
+	commit = (char *)(((uintptr_t)old_brk + incr + MEM_COMMIT - 1) & ~(uintptr_t)(MEM_COMMIT - 1));
+	if (mprotect(mem_commit[region], commit - mem_commit[region],
+		     PROT_READ | PROT_WRITE) < 0) {
+	    errno = ENOMEM;
+	    fprintf(stderr, "ERROR: mem_sbrk failed. Cannot commit memory...\n");
+	    return (void *)-1;
+	}
+	mem_commit[region] = commit;
+    }
+    mem_brk[region] += incr;
+    if (mem_brk[region] > mem_dirty[region])
+	mem_dirty[region] = mem_brk[region];
+
+    mem_account(incr);
+    /* the pages above the new brk go back, up to the end of the page
+       holding the last byte ever used, which leaves the region clean */
+    if (incr < 0) {
+	size_t page = mem_pagesize();
+	char *end = (char *)(((uintptr_t)mem_dirty[region] + page - 1) & ~(uintptr_t)(page - 1));
+	mem_release(mem_brk[region], (size_t)(end - mem_brk[region]));
+    }
     return (void *)old_brk;
 }
 
+/*
+ * mem_account - add incr bytes to the memory in use and track its peak;
+ *    regions and mappings may change concurrently, so this is atomic
+ */
+static void mem_account(long incr)
+{
+    size_t total = __atomic_add_fetch(&mem_total, (size_t)incr, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&mem_peak, __ATOMIC_RELAXED);
+
+    while (total > peak && !__atomic_compare_exchange_n(&mem_peak, &peak, total,
+		1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+}
+
+/*
+ * mem_map - model of mmap for memory outside the regions. Returns a new
+ *    page-aligned mapping of len bytes, or (void *)-1 on failure. Mapped
+ *    bytes count towards the peak that mem_heap_peak reports.
+ */
+void *mem_map(size_t len)
+{
+    char *addr;
+    mem_mapping_t *maps;
+
+    addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+	fprintf(stderr, "ERROR: mem_map failed. Ran out of memory...\n");
+	return (void *)-1;
+    }
+
+    while (__atomic_exchange_n(&mem_maps_lock, 1, __ATOMIC_ACQUIRE))
+	;
+    if (mem_nmaps == mem_maxmaps) {
+	maps = realloc(mem_maps, 2 * (mem_maxmaps + 8) * sizeof(mem_mapping_t));
+	if (maps == NULL) {
+	    __atomic_store_n(&mem_maps_lock, 0, __ATOMIC_RELEASE);
+	    munmap(addr, len);
+	    return (void *)-1;
+	}
+	mem_maps = maps;
+	mem_maxmaps = 2 * (mem_maxmaps + 8);
+    }
+    mem_maps[mem_nmaps].addr = addr;
+    mem_maps[mem_nmaps].len = len;
+    mem_nmaps++;
+    mem_mapped += len;
+    __atomic_store_n(&mem_maps_lock, 0, __ATOMIC_RELEASE);
+
+    mem_account(len);
+    return addr;
+}
+
+/*
+ * mem_unmap - remove a mapping made by mem_map
+ */
+void mem_unmap(void *addr, size_t len)
+{
+    int i;
+
+    while (__atomic_exchange_n(&mem_maps_lock, 1, __ATOMIC_ACQUIRE))
+	;
+    for (i = 0; i < mem_nmaps; i++)
+	if (mem_maps[i].addr == addr) {
+	    mem_maps[i] = mem_maps[--mem_nmaps];
+	    mem_mapped -= len;
+	    break;
+	}
+    __atomic_store_n(&mem_maps_lock, 0, __ATOMIC_RELEASE);
+
+    munmap(addr, len);
+    mem_account(-(long)len);
+}
+
+/*
+ * mem_remap - resize a mapping made by mem_map, moving it if it cannot
+ *    grow in place; returns its new address, or (void *)-1 on failure
+ */
+void *mem_remap(void *addr, size_t old_len, size_t new_len)
+{
+    char *new_addr;
+    int i;
+
+    new_addr = mremap(addr, old_len, new_len, MREMAP_MAYMOVE);
+    if (new_addr == MAP_FAILED) {
+	fprintf(stderr, "ERROR: mem_remap failed. Ran out of memory...\n");
+	return (void *)-1;
+    }
+
+    while (__atomic_exchange_n(&mem_maps_lock, 1, __ATOMIC_ACQUIRE))
+	;
+    for (i = 0; i < mem_nmaps; i++)
+	if (mem_maps[i].addr == addr) {
+	    mem_maps[i].addr = new_addr;
+	    mem_maps[i].len = new_len;
+	    mem_mapped += new_len - old_len;
+	    break;
+	}
+    __atomic_store_n(&mem_maps_lock, 0, __ATOMIC_RELEASE);
+
+    mem_account((long)new_len - (long)old_len);
+    return new_addr;
+}
+
+/*
+ * mem_unmap_all - remove every mapping, as part of resetting the model
+ */
+static void mem_unmap_all(void)
+{
+    while (mem_nmaps > 0) {
+	mem_nmaps--;
+	munmap(mem_maps[mem_nmaps].addr, mem_maps[mem_nmaps].len);
+    }
+    mem_mapped = 0;
+}
+
+/*
+ * mem_in_map - returns whether [lo, hi] lies within a single mapping
+ */
+int mem_in_map(void *lo, void *hi)
+{
+    int i, found = 0;
+
+    while (__atomic_exchange_n(&mem_maps_lock, 1, __ATOMIC_ACQUIRE))
+	;
+    for (i = 0; i < mem_nmaps && !found; i++)
+	found = (char *)lo >= mem_maps[i].addr
+	    && (char *)hi < mem_maps[i].addr + mem_maps[i].len;
+    __atomic_store_n(&mem_maps_lock, 0, __ATOMIC_RELEASE);
+    return found;
+}
+
+/*
+ * mem_mapsize - returns the number of bytes in all mappings
+ */
+size_t mem_mapsize()
+{
+    return mem_mapped;
+}
+
+/*
+ * mem_release - give the whole pages inside [addr, addr+len) back to the
+ *    system, like madvise(MADV_DONTNEED); they read as zero when touched
+ *    again
+ */
+void mem_release(void *addr, size_t len)
+{
+    size_t page = mem_pagesize();
+    uintptr_t lo = ((uintptr_t)addr + page - 1) & ~(page - 1);
+    uintptr_t hi = ((uintptr_t)addr + len) & ~(page - 1);
+    char *end = (char *)addr + len;
+    int i;
+
+    if (lo >= hi)
+	return;
+    madvise((void *)lo, hi - lo, MADV_DONTNEED);
+
+    /* a region whose data ended inside the range is zero from lo on */
+    for (i = 0; i < MEM_REGIONS; i++) {
+	char *rlo = mem_region_lo(i);
+	if (end <= rlo)
+	    break;
+	if (rlo + mem_span <= (char *)addr)
+	    continue;
+	if ((char *)lo <= mem_dirty[i] && mem_dirty[i] <= (char *)hi)
+	    mem_dirty[i] = (char *)lo > rlo ? (char *)lo : rlo;
+    }
+}
+
+/*
+ * mem_resident - returns the number of bytes of the regions in use that
+ *    are resident in physical memory
+ */
+size_t mem_resident()
+{
+    size_t page = mem_pagesize();
+    size_t resident = 0, npages, j;
+    uintptr_t lo;
+    unsigned char *vec;
+    int i;
+
+    for (i = 0; i < MEM_REGIONS; i++) {
+	if (mem_region_size(i) == 0)
+	    continue;
+	lo = (uintptr_t)mem_region_lo(i) & ~(page - 1);
+	npages = ((uintptr_t)mem_brk[i] - lo + page - 1) / page;
+	if ((vec = (unsigned char *)malloc(npages)) == NULL)
+	    return 0;
+	if (mincore((void *)lo, (uintptr_t)mem_brk[i] - lo, vec) == 0)
+	    for (j = 0; j < npages; j++)
+		resident += (vec[j] & 1) * page;
+	free(vec);
+    }
+    return resident;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -77,19 +411,89 @@ void *mem_heap_lo()
 }
 
 /* 
- * mem_heap_hi - return address of last heap byte
+ * mem_heap_hi - return address of last heap byte, the last byte of
+ *    the highest region in use
  */
 void *mem_heap_hi()
 {
-    return (void *)(mem_brk - 1);
+    int i = MEM_REGIONS - 1;
+
+    while (i > 0 && mem_region_size(i) == 0)
+	i--;
+    return (void *)(mem_brk[i] - 1);
 }
 
 /*
- * mem_heapsize() - returns the heap size in bytes
+ * mem_heapsize() - returns the heap size in bytes, summed over all regions
  */
 size_t mem_heapsize() 
 {
-    return (size_t)(mem_brk - mem_start_brk);
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < MEM_REGIONS; i++)
+	size += mem_region_size(i);
+    return size;
+}
+
+/*
+ * mem_heap_peak() - returns the largest heap size, mappings included,
+ *    since the last mem_reset_brk, which is what the heap cost at its
+ *    high-water mark
+ */
+size_t mem_heap_peak()
+{
+    return __atomic_load_n(&mem_peak, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_region_lo - return address of the first byte of a region
+ */
+void *mem_region_lo(int region)
+{
+    return (void *)(mem_start_brk + (size_t)region * mem_span);
+}
+
+/*
+ * mem_region_limit - return the most bytes a region may hold
+ */
+size_t mem_region_limit()
+{
+    return mem_limit;
+}
+
+/*
+ * mem_region_span - return the distance in bytes between the starts of
+ *    two regions, a power of two at least as large as the limit
+ */
+size_t mem_region_span()
+{
+    return mem_span;
+}
+
+/*
+ * mem_region_hi - return address of the last byte of a region
+ */
+void *mem_region_hi(int region)
+{
+    return (void *)(mem_brk[region] - 1);
+}
+
+/*
+ * mem_region_zero - return the address from which on a region has never
+ *    held data since it was last released, so that it reads as zero
+ */
+void *mem_region_zero(int region)
+{
+    return (void *)mem_dirty[region];
+}
+
+/*
+ * mem_region_size - returns the size of a region in bytes
+ */
+size_t mem_region_size(int region)
+{
+    return (size_t)(mem_brk[region] - (char *)mem_region_lo(region));
 }
 
 /*
@@ -1,5 +1,9 @@
 #include <unistd.h>
 
+#define MEM_REGIONS 8 /* number of independently growable regions */
+
+void mem_set_limit(size_t limit);
+void mem_set_hugepages(int on);
 void mem_init(void);               
 void mem_deinit(void);
 void *mem_sbrk(int incr);
@@ -8,4 +12,20 @@ void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
+size_t mem_heap_peak(void);
+void mem_release(void *addr, size_t len);
+size_t mem_resident(void);
+
+void *mem_map(size_t len);
+void mem_unmap(void *addr, size_t len);
+void *mem_remap(void *addr, size_t old_len, size_t new_len);
+int mem_in_map(void *lo, void *hi);
+size_t mem_mapsize(void);
 
+void *mem_region_sbrk(int region, long incr);
+void *mem_region_lo(int region);
+void *mem_region_hi(int region);
+void *mem_region_zero(int region);
+size_t mem_region_size(int region);
+size_t mem_region_limit(void);
+size_t mem_region_span(void);
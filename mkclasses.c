@@ -0,0 +1,312 @@
+/*
+ * mkclasses.c - size-class table generator for mm.c
+ *
+ * Reads malloc lab trace files, builds the histogram of the adjusted
+ * block sizes their requests ask the segregated lists for, and prints a
+ * SIZE_CLASS_LIMITS definition whose class bounds fit that histogram:
+ *
+ *	unix> mkclasses traces/amptjp-bal.rep traces/cccp-bal.rep > sizeclasses.h
+ *
+ * A first-fit search of a list passes over the blocks that are too
+ * small for the request, so a list costs about one wasted probe for
+ * every pair of requests of different sizes it holds. The bounds are
+ * chosen by dynamic programming to minimize the sum of that cost over
+ * all lists; a size that is requested very often gets a list of its own.
+ *
+ * With -l the bounds are given instead of derived from traces; this is
+ * how the default table of mm.c, sizeclasses-default.h, is made:
+ *
+ *	unix> mkclasses -l 16,32,64,128,256,512,1024,2048,4096,8192 > sizeclasses-default.h
+ *
+ * Either way the bounds are checked against the rules of mm.c and
+ * printed together with size_class_map, the class of every multiple of
+ * DSIZE up to TREE_MIN_SIZE, so that mm.c finds a class by one lookup.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* these must match mm.c */
+#define WSIZE 4
+#define DSIZE 8
+#define MIN_BLOCK_SIZE 16
+#define SLAB_MAX_SIZE 64    /* smaller requests never reach the lists */
+#define TREE_MIN_SIZE (1<<14) /* larger blocks go to the tree */
+
+#define MAX_CLASS_LIMITS 24 /* the most bounds mm.c accepts */
+
+#define MAX_LIMITS 10       /* the bounds mm.c has by default */
+#define NUM_SIZES (TREE_MIN_SIZE/DSIZE + 1)
+
+static double hist[NUM_SIZES]; /* requests per adjusted size / DSIZE */
+
+/*
+ * check_limits - exit unless the n bounds are what mm.c accepts: at most
+ * MAX_CLASS_LIMITS increasing multiples of DSIZE, the first at least
+ * MIN_BLOCK_SIZE and all below TREE_MIN_SIZE
+ */
+static void check_limits(int *limit, int n)
+{
+    int i;
+
+    if (n < 1 || n > MAX_CLASS_LIMITS) {
+	fprintf(stderr, "mkclasses: %d class bounds, need 1 to %d\n",
+		n, MAX_CLASS_LIMITS);
+	exit(1);
+    }
+    for (i = 0; i < n; i++) {
+	if (limit[i] % DSIZE != 0 || limit[i] < MIN_BLOCK_SIZE ||
+	    limit[i] >= TREE_MIN_SIZE || (i > 0 && limit[i] <= limit[i - 1])) {
+	    fprintf(stderr, "mkclasses: bad class bound %d: the bounds must be "
+		    "increasing multiples of %d from %d to below %d\n",
+		    limit[i], DSIZE, MIN_BLOCK_SIZE, TREE_MIN_SIZE);
+	    exit(1);
+	}
+    }
+}
+
+/*
+ * print_classes - print the n bounds and the class of each size they give
+ */
+static void print_classes(int *limit, int n)
+{
+    int i, k, size_class = 0;
+
+    check_limits(limit, n);
+    printf("#define SIZE_CLASS_LIMITS");
+    for (i = 0; i < n; i++)
+	printf(" %d%s", limit[i], i < n - 1 ? "," : "");
+    printf("\n\n");
+
+    /* a size belongs to the first list whose bound it does not exceed,
+       or to the last list */
+    printf("/* the class of each adjusted size / DSIZE up to TREE_MIN_SIZE */\n");
+    printf("static const unsigned char size_class_map[] = {");
+    for (k = 0; k < NUM_SIZES; k++) {
+	while (size_class < n && k * DSIZE > limit[size_class])
+	    size_class++;
+	printf("%s%d%s", k % 16 == 0 ? "\n    " : " ", size_class,
+	       k < NUM_SIZES - 1 ? "," : "");
+    }
+    printf("\n};\n");
+}
+
+/*
+ * parse_limits - read a comma-separated list of bounds into limit
+ */
+static int parse_limits(char *list, int *limit)
+{
+    char *end;
+    int n = 0;
+
+    for (;;) {
+	if (n == MAX_CLASS_LIMITS) {
+	    fprintf(stderr, "mkclasses: more than %d class bounds\n", MAX_CLASS_LIMITS);
+	    exit(1);
+	}
+	limit[n++] = (int) strtol(list, &end, 10);
+	if (end == list || (*end != ',' && *end != '\0')) {
+	    fprintf(stderr, "mkclasses: bad class bound list %s\n", list);
+	    exit(1);
+	}
+	if (*end == '\0')
+	    return n;
+	list = end + 1;
+    }
+}
+
+/*
+ * count - add n requests of size bytes to the histogram
+ */
+static void count(unsigned int size, unsigned int n)
+{
+    size_t asize;
+
+    if (size <= SLAB_MAX_SIZE)
+	return;
+    asize = DSIZE * ((size + WSIZE + (DSIZE-1)) / DSIZE);
+    if (asize < MIN_BLOCK_SIZE)
+	asize = MIN_BLOCK_SIZE;
+    if (asize <= TREE_MIN_SIZE)
+	hist[asize / DSIZE] += n;
+}
+
+/*
+ * read_trace - add the requests of one trace file to the histogram
+ */
+static void read_trace(char *path)
+{
+    FILE *f;
+    char type[2];
+    unsigned int index, size, align, n, skip;
+
+    if ((f = fopen(path, "r")) == NULL) {
+	fprintf(stderr, "mkclasses: could not open %s\n", path);
+	exit(1);
+    }
+    /* heap size, number of ids, number of ops, weight */
+    if (fscanf(f, "%u %u %u %u", &skip, &skip, &skip, &skip) != 4) {
+	fprintf(stderr, "mkclasses: bad header in %s\n", path);
+	exit(1);
+    }
+    while (fscanf(f, "%1s", type) == 1) {
+	switch (type[0]) {
+	case 'a':
+	case 'r':
+	case 'c':
+	    if (fscanf(f, "%u %u", &index, &size) == 2)
+		count(size, 1);
+	    break;
+	case 'm':
+	    if (fscanf(f, "%u %u %u", &index, &align, &size) == 3)
+		count(size, 1);
+	    break;
+	case 'A':
+	    if (fscanf(f, "%u %u %u", &index, &n, &size) == 3)
+		count(size, n);
+	    break;
+	case 'f':
+	    if (fscanf(f, "%u", &index) != 1)
+		index = 0;
+	    break;
+	case 'F':
+	    if (fscanf(f, "%u %u", &index, &n) != 2)
+		index = 0;
+	    break;
+	default:
+	    fprintf(stderr, "mkclasses: bogus type character (%c) in %s\n",
+		    type[0], path);
+	    exit(1);
+	}
+    }
+    fclose(f);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: mkclasses [-h] [-k <n>] <trace>...\n");
+    fprintf(stderr, "       mkclasses -l <list>\n");
+    fprintf(stderr, "\t-k <n>     Print at most n class bounds (default %d, at most %d).\n",
+	    MAX_LIMITS, MAX_CLASS_LIMITS);
+    fprintf(stderr, "\t-l <list>  Print the table for these comma-separated bounds.\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+}
+
+int main(int argc, char **argv)
+{
+    int sizes[NUM_SIZES];     /* the requested sizes / DSIZE, increasing */
+    double s1[NUM_SIZES + 1]; /* requests of the first j sizes ... */
+    double s2[NUM_SIZES + 1]; /* ... and the sum of their squares */
+    double *cost, *prev, pairs, c;
+    int *cut;                 /* cut[g*(m+1)+j]: start of the last of g+1 lists holding the first j sizes */
+    int limits = MAX_LIMITS, m = 0, groups, g, i, j, k, ch;
+    int bound[NUM_SIZES], limit[MAX_CLASS_LIMITS];
+    char *list = NULL;
+
+    while ((ch = getopt(argc, argv, "hk:l:")) != EOF) {
+	switch (ch) {
+	case 'k':
+	    limits = atoi(optarg);
+	    break;
+	case 'l':
+	    list = optarg;
+	    break;
+	case 'h':
+	    usage();
+	    exit(0);
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    if (list != NULL) {
+	if (optind != argc) {
+	    usage();
+	    exit(1);
+	}
+	k = parse_limits(list, limit);
+	printf("/* generated by mkclasses -l %s */\n", list);
+	print_classes(limit, k);
+	return 0;
+    }
+    if (optind == argc || limits < 1 || limits > MAX_CLASS_LIMITS) {
+	usage();
+	exit(1);
+    }
+    for (i = optind; i < argc; i++)
+	read_trace(argv[i]);
+
+    s1[0] = s2[0] = 0;
+    for (k = 0; k < NUM_SIZES; k++) {
+	if (hist[k] == 0)
+	    continue;
+	sizes[m] = k;
+	s1[m + 1] = s1[m] + hist[k];
+	s2[m + 1] = s2[m] + hist[k] * hist[k];
+	m++;
+    }
+    if (m == 0) {
+	fprintf(stderr, "mkclasses: no requests reach the lists\n");
+	exit(1);
+    }
+
+    /* the last list always ends at TREE_MIN_SIZE, so limits bounds give
+       limits + 1 lists */
+    groups = (m < limits + 1) ? m : limits + 1;
+    cost = malloc((m + 1) * sizeof(double));
+    prev = malloc((m + 1) * sizeof(double));
+    cut = malloc(groups * (m + 1) * sizeof(int));
+    if (cost == NULL || prev == NULL || cut == NULL) {
+	fprintf(stderr, "mkclasses: out of memory\n");
+	exit(1);
+    }
+
+    /* one list: all pairs of different sizes */
+    for (j = 0; j <= m; j++) {
+	prev[j] = (s1[j] * s1[j] - s2[j]) / 2;
+	cut[j] = 0;
+    }
+    /* g + 1 lists: the best split of the first i sizes into g lists,
+       followed by a list of sizes i..j-1 */
+    for (g = 1; g < groups; g++) {
+	for (j = 0; j <= m; j++) {
+	    cost[j] = prev[j];
+	    cut[g*(m+1) + j] = j;
+	    for (i = g; i < j; i++) {
+		pairs = s1[j] - s1[i];
+		c = prev[i] + (pairs * pairs - (s2[j] - s2[i])) / 2;
+		if (c < cost[j]) {
+		    cost[j] = c;
+		    cut[g*(m+1) + j] = i;
+		}
+	    }
+	}
+	memcpy(prev, cost, (m + 1) * sizeof(double));
+    }
+
+    /* walk the cuts back; a list ending at size index j-1 is bounded by
+       that size, except the last one */
+    k = 0;
+    for (g = groups - 1, j = m; g > 0; g--) {
+	i = cut[g*(m+1) + j];
+	if (i > 0 && i < j)
+	    bound[k++] = sizes[i - 1] * DSIZE;
+	j = i;
+    }
+
+    printf("/* generated by mkclasses from %d trace%s: %.0f requests of %d sizes,\n",
+	   argc - optind, argc - optind > 1 ? "s" : "", s1[m], m);
+    printf("   %.0f pairs of requests of different sizes share a list */\n", prev[m]);
+    for (i = 0; i < k; i++)
+	limit[i] = bound[k - 1 - i];
+    /* a single size still needs one bound */
+    if (k == 0)
+	limit[k++] = sizes[0] * DSIZE < TREE_MIN_SIZE ? sizes[0] * DSIZE : TREE_MIN_SIZE / 2;
+    print_classes(limit, k);
+
+    free(cost);
+    free(prev);
+    free(cut);
+    return 0;
+}
@@ -1,10 +1,113 @@
 /*
  * Segregated Free List. First-fit strategy.
- * There are 17 size classes, and the size classes corresponds to
+ * There are 12 size classes by default, and the size classes corresponds to
  * an array of free lists allocated on the heap. Each array contains
  * free blocks of sizes within a certain range.
  * A simple first-fit strategy is used because in segregrated free
  * lists, it approximates the performance of best fit.
+ * The class bounds (SIZE_CLASS_LIMITS) and the search within a list
+ * (FIT_POLICY, FIT_MAX_PROBES) are compile-time settings, so a build
+ * tuned to other request sizes, a best-fit or next-fit build, or one
+ * with a bounded search needs no fork of this file and no dispatch at
+ * run time.
+ * Each list is circular and doubly linked through a sentinel head in
+ * the index, so linking and unlinking a block are four unconditional
+ * stores with no test for an empty list or an end.
+ * The last class (blocks above 16 KB) is not a list but a splay tree
+ * keyed on (size, address) and embedded in the free blocks, so large
+ * requests get a true best fit in amortized O(log n).
+ *
+ * Only free blocks carry a footer. Every header keeps a second flag
+ * bit recording whether the previous block is allocated, so coalescing
+ * only reads the previous footer when that block is known to be free,
+ * and an allocated block costs a single header word.
+ *
+ * Free-list links and list heads are stored as 32-bit offsets from
+ * the start of the heap (mem_heap_lo) rather than as raw pointers, so
+ * the allocator is 64-bit clean while a free block still fits in the
+ * 16-byte minimum. Offset 0 is never a block and serves as the null link.
+ *
+ * Requests of at most 64 bytes never reach the free-block index. They
+ * are served from page-sized slabs, each an allocated block aligned to
+ * SLAB_SIZE that holds objects of a single size class with no header
+ * per object. A slab starts with a small descriptor and a bitmap of its
+ * free slots; a bitmap kept outside the heap marks which heap pages are
+ * slabs, so mm_free finds the slab of a pointer by masking its offset.
+ * Slabs with free slots are linked per class, and an empty slab is given
+ * back to the block heap unless it is the last one of its class.
+ *
+ * Freed blocks of up to QUICK_MAX_SIZE bytes are not coalesced right
+ * away. They are parked, still allocated, on a quick list of their exact
+ * size, from which malloc takes them back without touching any header or
+ * index link. A list that grows to QUICK_LIMIT blocks is freed as a batch,
+ * and all lists are when the index has no fit, before the heap grows.
+ *
+ * mm_memalign places a block so that its payload is aligned, in a free
+ * block that holds it or at the end of the heap. The space in front of
+ * the payload is left either empty or large enough to be a free block,
+ * which goes back to the index. Aligned blocks always carry a header and
+ * never come from slabs or mappings.
+ *
+ * mm_calloc clears only memory that may have been used. Each arena
+ * records from where on the free block ending its heap still reads as
+ * zero, as memlib handed it out or released it, and a block carved from
+ * that block is cleared only up to there. Mappings are always fresh.
+ *
+ * The free block ending the heap, the wilderness, is used last: malloc
+ * takes it only when no other free block fits, and when even it is too
+ * small the heap grows by just what it lacks. Only a heap that keeps
+ * growing, GROW_SLOW extensions in a row without a hole being reused,
+ * grows by steps that double from CHUNKSIZE up to GROW_MAX.
+ *
+ * Building with -DMM_THREADS=1 makes the package thread-safe. The heap
+ * above, called the core, is replicated into arenas, one per memlib
+ * region, each with its own index, slabs and mutex. A thread is given
+ * an arena on its first call and allocates only from it, while a block
+ * is always freed into the arena whose region holds it, so threads
+ * working on their own blocks share no list heads or headers. The
+ * arena a core function works on is selected by the thread-local
+ * heap_listp/freelist_p/cur_arena, set when its mutex is taken.
+ *
+ * In front of its arena every thread keeps a bounded cache of free
+ * blocks per request class. A thread that finds its cache empty takes
+ * TCACHE_BATCH blocks from the arena under one lock, and a full cache
+ * gives TCACHE_BATCH back the same way, so most malloc and free calls of
+ * small blocks never take the lock. Only blocks of the thread's own arena
+ * are cached, and cached blocks stay allocated as far as the arena is
+ * concerned. A thread cache lives in a block of the arena and is drained
+ * when its thread exits.
+ *
+ * A thread that frees a block of another arena does not take that
+ * arena's mutex. It pushes the block onto the arena's remote-free queue,
+ * a lock-free stack of block offsets kept in the arena index, with one
+ * compare-and-swap. Whoever next holds the arena mutex detaches the whole
+ * queue with one exchange and frees the blocks normally, so they are
+ * coalesced as usual. The owner drains it from mm_malloc once
+ * TCACHE_BATCH blocks are waiting, and a producer that finds REMOTE_LIMIT
+ * blocks waiting drains it itself if the mutex happens to be free.
+ *
+ * Free memory is given back to memlib once it has stayed unused for a
+ * while. Every PURGE_INTERVAL frees an arena is purged: a free block of
+ * at least TRIM_THRESHOLD bytes at the end of the heap is cut down to
+ * CHUNKSIZE by shrinking the heap, and the pages inside any other free
+ * block that large are released with mem_release, but only if the block
+ * was already free at the previous purge. A block that is coalesced or
+ * allocated in between starts over, so memory that keeps being reused
+ * never pays for page faults. mm_trim purges everything at once.
+ *
+ * Requests of MMAP_THRESHOLD bytes or more bypass all of the above.
+ * Each is a memlib mapping of its own, so mm_free gives it back at once
+ * and mm_realloc resizes it by remapping instead of copying. Mapped
+ * blocks are told apart by lying outside every region.
+ *
+ * Building with -DTLSF=1 swaps the free-block index for a two-level
+ * segregated fit (TLSF) one. The first level splits sizes by powers
+ * of two, the second level splits each power of two into SL_COUNT
+ * linear ranges, and a bitmap per level records the non-empty lists.
+ * A request is rounded up to the next second-level range so that the
+ * head of any list found by find-first-set is guaranteed to fit, which
+ * gives malloc and free a constant bound. The block layout, coalescing
+ * and splitting are shared by both engines.
  */
 
 #include <stdio.h>
@@ -12,9 +115,13 @@
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#if MM_THREADS
+#include <pthread.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
+#include "config.h"
 
 /*********************************************************
  * NOTE TO STUDENTS: Before you do anything else, please
@@ -47,19 +154,136 @@ team_t team = {
 #define DEBUG_PLACE 0
 #define DEBUG_INSERT 0
 #define DEBUG_DELETE 0
+// set to 1 to check the size passed to mm_free_sized against the block
+#ifndef DEBUG_FREE_SIZE
+#define DEBUG_FREE_SIZE 0
+#endif
+// set to 1 to count free-block searches and their probes for mm_fit_stats
+#ifndef FIT_STATS
+#define FIT_STATS 0
+#endif
+
+// free-block index: 0 for segregated first fit, 1 for two-level segregated fit
+#ifndef TLSF
+#define TLSF 0
+#endif
+
+// 1 for a thread-safe build with per-thread caches
+#ifndef MM_THREADS
+#define MM_THREADS 0
+#endif
+
+// order of the segregated lists until mm_set_policy picks another:
+// MM_LIFO or MM_ADDRESS_ORDER (mm.h); the TLSF lists are always LIFO
+#ifndef FREE_POLICY
+#define FREE_POLICY MM_LIFO
+#endif
+
+// how find_fit picks a block within a segregated list: the first that
+// fits, the smallest that fits (an exact fit ends the search), or the
+// first that fits after the block the last search of that list took
+#define FIT_FIRST 0
+#define FIT_BEST 1
+#define FIT_NEXT 2
+#ifndef FIT_POLICY
+#define FIT_POLICY FIT_FIRST
+#endif
+
+// how many blocks find_fit looks at in one segregated list before it
+// moves on to the next one; 0 means the whole list
+#ifndef FIT_MAX_PROBES
+#define FIT_MAX_PROBES 0
+#endif
+
+// largest adjusted size of each segregated list but the last, in
+// increasing multiples of DSIZE (the last list ends at TREE_MIN_SIZE),
+// and the class of every multiple of DSIZE up to TREE_MIN_SIZE; mkclasses
+// checks the bounds and makes both, into the header given with -include
+// (make mdriver-classes) or else the default one
+#if !TLSF
+#ifndef SIZE_CLASS_LIMITS
+#include "sizeclasses-default.h"
+#endif
+#endif
+#define MAX_CLASS_LIMITS 24
+#define NUM_CLASS_LIMITS (sizeof(class_limit) / sizeof(class_limit[0]))
 
 /* Macros (partially from CS:APP3e) */
 #define WSIZE 4 // single word size in bytes
 #define DSIZE 8 // double word size 
 #define CHUNKSIZE (1<<12) // extend the heap by this many bytes
-#define NUM_SIZE_CLASS 17 // number of size classes
-#define MIN_BLOCK_SIZE (4*WSIZE) // header, footer, pred, succ
+#define GROW_SLOW 2 // heap extensions in a row that add just what a request lacks ...
+#define GROW_MAX (1<<14) // ... before the steps double from CHUNKSIZE up to this many bytes
+#define NUM_SIZE_CLASS ((int) NUM_CLASS_LIMITS + 2) // the last class is the tree
+#define MIN_BLOCK_SIZE (4*WSIZE) // header, pred, succ, footer (when free)
+#define MAX_REQUEST ((1U<<31) - 2*DSIZE) // largest payload a 32-bit header and mem_sbrk can serve
+#define TRIM_THRESHOLD (1<<17) // free blocks this large are given back to memlib ...
+#define PURGE_INTERVAL (1<<12) // ... by a purge run every this many frees
+
+// requests of at least this many bytes get a memlib mapping of their own
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (1<<17)
+#endif
+
+/* slab parameters */
+#define SLAB_SIZE (1<<12) // bytes of a slab, also its alignment
+#define SLAB_MAX_SIZE 64 // largest request served from a slab
+#define SLAB_CLASSES (SLAB_MAX_SIZE / DSIZE) // one class per multiple of DSIZE
+#define SLAB_MAP_WORDS (0x100000000ULL / SLAB_SIZE / 32) // one bit per page a region can span
+
+/* quick list parameters */
+#define QUICK_MAX_SIZE 512 // largest adjusted block size parked in a quick list
+#define QUICK_CLASSES ((QUICK_MAX_SIZE - SLAB_MAX_SIZE) / DSIZE) // one list per size above the slabs
+#define QUICK_LIMIT 32 // parked blocks at which a quick list is coalesced
+
+/* thread cache parameters */
+#define TCACHE_MAX_SIZE 512 // largest adjusted block size kept in a thread cache
+#define TCACHE_CLASSES (SLAB_CLASSES + (TCACHE_MAX_SIZE - SLAB_MAX_SIZE) / DSIZE)
+#define TCACHE_LIMIT 16 // most blocks a thread keeps per class
+#define TCACHE_BATCH 8 // blocks moved between a thread cache and the core at once
+#define REMOTE_LIMIT 64 // queued remote frees at which a freeing thread tries to drain them
+
+/* skip list parameters of address-ordered lists */
+#define SKIP_LEVELS 6 // levels above the list itself; a block reaches each next one with odds 1/4
+#define LINK_BYTES (DSIZE * (1 + SKIP_LEVELS)) // bytes at the start of a free block that links may use
+
+/* TLSF index parameters */
+#define SL_LOG2 4 // log2 of the number of second-level lists per first level
+#define SL_COUNT (1<<SL_LOG2)
+#define FL_SHIFT (SL_LOG2 + 3) // sizes below 2^FL_SHIFT are spread linearly by DSIZE
+#define FL_MAX 31 // highest bit a 32-bit header size can have
+#define FL_COUNT (FL_MAX - FL_SHIFT + 2)
+#define SMALL_BLOCK_SIZE (1<<FL_SHIFT)
+
+// words reserved in front of the prologue for the free-block index;
+// the first word stays unused so that no list head sits at offset 0 (the null link),
+// and the count is kept odd so that the prologue payload stays double-word aligned
+// the slab list heads follow the free-block index
+#if TLSF
+#define LIST_WORDS (1 + FL_COUNT + FL_COUNT*SL_COUNT) // fl bitmap, sl bitmaps, heads
+#define SKIP_WORDS 0
+#else
+#define LIST_WORDS (2*(NUM_SIZE_CLASS-1) + 1 + ROVER_WORDS) // list sentinels, tree root, rovers
+// address-ordered lists add the heads of the skip levels of every list but the tree
+#define SKIP_WORDS ((NUM_SIZE_CLASS-1) * SKIP_LEVELS)
+#endif
+// the thread-safe build adds the head and length of the remote-free queue
+#define REMOTE_WORDS (2 * MM_THREADS)
+// then the number of frees since the last purge, the quick list heads,
+// where the free block ending the heap starts to read as zero, the number
+// of heap extensions in a row, and finally the skip list heads
+#define INDEX_WORDS ((1 + LIST_WORDS + SLAB_CLASSES + REMOTE_WORDS + 1 + QUICK_CLASSES + 1 + 1 + SKIP_WORDS) | 1)
 
 #define MAX(x, y) ((x) > (y)? (x): (y))
 #define MIN(x, y) ((x) > (y)? (y): (x))
 
 // pack a size and allocated bit into a word to be used as header/footer        
 #define PACK(size, alloc) ((size) | (alloc))
+#define PREV_ALLOC 0x2 // header bit set when the previous block is allocated
+#define GROWN 0x4 // header bit of an allocated block that realloc has grown
+#define AGED 0x4 // header bit of a free block that was free at the last purge already
+// size of a grown block with headroom for the next few increments
+#define GROW_SIZE(asize) ((asize) + (((asize) / 2) & ~0x7))
 
 // read/write a word at address p (a void pointer)
 #define GET(p) (*(unsigned int *) (p))
@@ -68,41 +292,261 @@ team_t team = {
 // read the size/allocated info from p (pointing to a header/footer)
 #define GET_SIZE(p) (GET(p) & ~0x7) // zero out the last 3 bits
 #define GET_ALLOC(p) (GET(p) & 0x1) // get the last bit
+#define GET_PREV_ALLOC(p) (GET(p) & PREV_ALLOC)
+#define SET_PREV_ALLOC(p) PUT(p, GET(p) | PREV_ALLOC)
+#define CLR_PREV_ALLOC(p) PUT(p, GET(p) & ~PREV_ALLOC)
 
 // given block pointer (first payload byte), compute addresses of header/footer/pred/succ
+// only free blocks have a footer
 #define HDRP(bp) ((char *) (bp) - WSIZE) // convert to char pointer so that pointer arithmetics operate in bytes
 #define FTRP(bp) ((char *) (bp) + GET_SIZE(HDRP(bp)) - DSIZE)
 #define PRED(bp) ((char *) (bp))
 #define SUCC(bp) ((char *) (bp + WSIZE))
 
 // given block pointer, compute addresses of previous/next block pointers
+// PREV_BLKP reads the previous footer, so it is only valid when that block is free
 #define PREV_BLKP(bp) ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
 #define NEXT_BLKP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)))
 
+// convert between heap addresses and the 32-bit offsets stored in links and list heads
+#define TO_OFFSET(p) ((unsigned int) ((char *) (p) - heap_base))
+#define FROM_OFFSET(off) ((off) ? heap_base + (off) : NULL)
+#define GET_PTR(p) FROM_OFFSET(GET(p))
+
 // given block pointer, compute addresses of predeccsor/successor block pointers
-#define PRED_BLKP(bp) ((char *) GET(PRED(bp)))
-#define SUCC_BLKP(bp) ((char *) GET(SUCC(bp)))
+#define PRED_BLKP(bp) GET_PTR(PRED(bp))
+#define SUCC_BLKP(bp) GET_PTR(SUCC(bp))
+
+// address of the head of a size class; a list is circular and its head is
+// a sentinel, a pseudo block in the index whose succ is the first block
+// of the list and whose pred the last one, or itself if the list is empty
+#define CLASS_HEAD(i) (freelist_p + DSIZE*(i))
+
+// links of a circular list are never null
+#define LIST_PRED(bp) (heap_base + GET(PRED(bp)))
+#define LIST_SUCC(bp) (heap_base + GET(SUCC(bp)))
+
+// blocks of the last size class form a splay tree keyed on (size, address)
+// a tree node reuses the pred/succ words as its left/right child offsets
+// the root is a single word following the sentinels
+#define TREE_ROOT CLASS_HEAD(NUM_SIZE_CLASS-1)
+#define TREE_MIN_SIZE (1<<14) // larger blocks go to the tree
+#define LEFT(bp) PRED(bp)
+#define RIGHT(bp) SUCC(bp)
+#define LEFT_BLKP(bp) PRED_BLKP(bp)
+#define RIGHT_BLKP(bp) SUCC_BLKP(bp)
+
+// compare the key (size, addr) against the key of tree node bp
+#define KEY_LESS(size, addr, bp) ((size) < GET_SIZE(HDRP(bp)) || \
+        ((size) == GET_SIZE(HDRP(bp)) && (char *) (addr) < (char *) (bp)))
+#define KEY_GREATER(size, addr, bp) ((size) > GET_SIZE(HDRP(bp)) || \
+        ((size) == GET_SIZE(HDRP(bp)) && (char *) (addr) > (char *) (bp)))
+
+// next fit keeps a rover per list after the tree root: the offset of the
+// block the last search of the list stopped at, or of its sentinel
+#define ROVER_WORDS (FIT_POLICY == FIT_NEXT ? NUM_SIZE_CLASS-1 : 0)
+#define ROVER(i) (TREE_ROOT + WSIZE*(1 + (i)))
+
+// addresses of the TLSF bitmaps and list heads
+#define FL_BITMAP (freelist_p)
+#define SL_BITMAP(fl) (freelist_p + WSIZE*(1 + (fl)))
+#define TLSF_HEAD(fl, sl) (freelist_p + WSIZE*(1 + FL_COUNT + (fl)*SL_COUNT + (sl)))
+
+// each arena lives in its own memlib region, REGION_SPAN bytes apart;
+// its index starts one word into the region and its prologue follows the index
+#define REGION_SPAN ((size_t) 1 << region_shift)
+#define REGION_OF(p) ((size_t) TO_OFFSET(p) >> region_shift)
+#define REGION_OFFSET(p) (TO_OFFSET(p) & (REGION_SPAN - 1))
+#define ARENA_INDEX(k) (heap_base + ((size_t) (k) << region_shift) + WSIZE)
+#define ARENA_PROLOGUE(k) (ARENA_INDEX(k) + INDEX_WORDS*WSIZE)
+
+// bytes from block pointer bp to the first payload position at or after it
+// that is a multiple of align, leaving either no gap or room for a free block
+#define ALIGN_GAP(bp, align) ((-(size_t) (bp) & ((align) - 1)) == 0 ? 0 : \
+        (-(size_t) (bp) & ((align) - 1)) + ((-(size_t) (bp) & ((align) - 1)) < MIN_BLOCK_SIZE ? (align) : 0))
+
+// a block outside every region is a mapping of its own, whose header
+// holds the size of the whole mapping; its payload starts DSIZE bytes in
+#define IS_MAPPED(p) ((size_t) ((char *) (p) - heap_base) >= (size_t) MEM_REGIONS << region_shift)
+
+// address of the head of the list of slabs of a class that have free slots
+#define SLAB_HEAD(i) (freelist_p + WSIZE*(LIST_WORDS + (i)))
+// address of the word of the slab page bitmap holding the bit of p,
+// which is found in the bitmap of the arena that owns p
+#define SLAB_MAP_WORD(p) (REGION_OFFSET(p) / SLAB_SIZE / 32)
+#define SLAB_MAP(p) (&slab_map[REGION_OF(p)][SLAB_MAP_WORD(p)])
+#define SLAB_BIT(p) (1U << (REGION_OFFSET(p) / SLAB_SIZE % 32))
+#define IS_SLAB(p) (GET(SLAB_MAP(p)) & SLAB_BIT(p))
+
+// given any pointer into a slab, compute the slab (its first payload byte)
+#define SLAB_OF(p) (heap_base + (TO_OFFSET(p) & ~(SLAB_SIZE-1)))
+
+// given a slab, compute addresses of the words of its descriptor
+#define SLAB_OBJ_SIZE(s) ((char *) (s)) // bytes per object
+#define SLAB_NOBJ(s) ((char *) (s) + WSIZE) // number of objects
+#define SLAB_NFREE(s) ((char *) (s) + 2*WSIZE) // number of free objects
+#define SLAB_NEXT(s) ((char *) (s) + 3*WSIZE) // offset of the next slab of the class
+#define SLAB_PREV(s) ((char *) (s) + 4*WSIZE) // offset of the previous slab of the class
+#define SLAB_FIRST(s) ((char *) (s) + 5*WSIZE) // offset of the first object from the slab
+#define SLAB_BITMAP(s) ((char *) (s) + 6*WSIZE) // one bit per object, set when free
+
+// head (offset of the last pushed block) and length of the remote-free
+// queue of arena k; a queued block stores the offset of the next one in
+// its first payload word
+#define REMOTE_HEAD(k) ((unsigned int *) (ARENA_INDEX(k) + WSIZE*(LIST_WORDS + SLAB_CLASSES)))
+#define REMOTE_COUNT(k) (REMOTE_HEAD(k) + 1)
+
+// address of the number of frees in the current arena since its last purge
+#define PURGE_CLOCK (freelist_p + WSIZE*(LIST_WORDS + SLAB_CLASSES + REMOTE_WORDS))
+
+// address of the head of the quick list of blocks of adjusted size asize;
+// a parked block stays allocated and stores the offset of the next one in
+// its first payload word and the length of the list from itself on in its second
+#define QUICK_HEAD(asize) (PURGE_CLOCK + WSIZE*(((asize) - SLAB_MAX_SIZE) / DSIZE))
+#define IS_QUICK_SIZE(asize) ((asize) > SLAB_MAX_SIZE && (asize) <= QUICK_MAX_SIZE)
+#define QUICK_NEXT(bp) PRED(bp)
+#define QUICK_LEN(bp) SUCC(bp)
+
+// address of the offset from which on the free block ending the heap is
+// known to read as zero up to its footer; the offset lies past the links
+// of that block, and it is 0 if there is no such block or nothing is known
+#define ZERO_FROM (PURGE_CLOCK + WSIZE*(1 + QUICK_CLASSES))
+
+// address of the number of times the heap was extended since a request
+// was last served from a free block other than the one ending the heap
+#define GROW_RUN (ZERO_FROM + WSIZE)
+
+// an address-ordered list is the bottom level of a skip list; a block on
+// level l > 0 links to the next block on that level at SKIP_NEXT and keeps
+// the offset of the word that links to it at SKIP_PREV
+// SKIP_HEAD is the word that links to the first block of level l of class i
+#define SKIP_HEAD(i, l) (GROW_RUN + WSIZE*(1 + (i)*SKIP_LEVELS + (l) - 1))
+#define SKIP_NEXT(bp, l) ((char *) (bp) + DSIZE*(l))
+#define SKIP_PREV(bp, l) ((char *) (bp) + DSIZE*(l) + WSIZE)
+
+// a thread cache is a core block holding the offset of the first cached
+// block and the number of cached blocks of each class; a cached block
+// stores the offset of the next one in its first payload word
+#define TCACHE_HEAD(c, i) ((char *) (c) + WSIZE*(i))
+#define TCACHE_NUM(c, i) ((char *) (c) + WSIZE*(TCACHE_CLASSES + (i)))
+#define TCACHE_BYTES (2 * TCACHE_CLASSES * WSIZE)
+
+// LOCK(k) takes the mutex of arena k and makes it the current arena,
+// UNLOCK() releases the current arena
+#if MM_THREADS
+#define LOCK(k) arena_lock(k)
+#define UNLOCK() pthread_mutex_unlock(&arena_mutex[cur_arena])
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
 
 
 /* End of Macros (partially from CS:APP3e) */
 
 
 /* private global variables */
-static char *heap_listp = 0; // first block pointer of the heap (prologue block)
-static char **freelist_p = 0; // pointer to the start an array of block pointers (free blocks) of different size classes
+static THREAD_LOCAL char *heap_listp = 0; // first block pointer of the arena (prologue block)
+static THREAD_LOCAL char *freelist_p = 0; // pointer to the start an array of block offsets (free blocks) of different size classes
+static THREAD_LOCAL int cur_arena = 0; // region of the arena the two above belong to
+static char *heap_base = 0; // first byte of the heap, the origin of all stored offsets
+static int region_shift = 0; // log2 of the distance between memlib regions
+static THREAD_LOCAL unsigned long fit_calls = 0; // find_fit searches since mm_init ...
+static THREAD_LOCAL unsigned long fit_probes = 0; // ... and the blocks or lists they looked at
+static int policy = FREE_POLICY; // order of the segregated lists ...
+static int next_policy = FREE_POLICY; // ... and the one mm_init switches to
+#if !TLSF
+static const unsigned int class_limit[] = { SIZE_CLASS_LIMITS }; // bounds of the size classes
+_Static_assert(NUM_CLASS_LIMITS <= MAX_CLASS_LIMITS,
+        "SIZE_CLASS_LIMITS holds more than MAX_CLASS_LIMITS bounds");
+_Static_assert(sizeof(size_class_map) == TREE_MIN_SIZE/DSIZE + 1,
+        "size_class_map must come from mkclasses with the TREE_MIN_SIZE of mm.c");
+#endif
+// the slab page bitmap of every arena lies outside the heap, as a bitmap
+// sized for the largest region would take a large part of a small heap;
+// only its pages that a slab was ever marked on get touched
+static unsigned int slab_map[MEM_REGIONS][SLAB_MAP_WORDS];
+static unsigned int slab_map_top[MEM_REGIONS]; // words of each bitmap that may hold a set bit
+#if MM_THREADS
+static pthread_mutex_t arena_mutex[MEM_REGIONS];
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key; // runs tcache_flush when a thread with a cache exits
+static int next_arena = 0; // arenas are handed out round robin ...
+static int num_arenas = 0; // ... among the regions 32-bit offsets can reach
+static __thread int thread_arena = -1; // arena of the calling thread
+static unsigned int heap_epoch = 0; // bumped by mm_init, so caches of an earlier heap are dropped
+static __thread char *tcache_p = 0; // cache of the calling thread
+static __thread unsigned int tcache_epoch = 0; // heap_epoch when tcache_p was allocated
+#endif
 
 /* private helper function definitions */
+static void *core_malloc(size_t size);
+static void *fit_or_extend(size_t asize);
+static void *grow_heap(size_t asize);
+static void *core_calloc(size_t size);
+static void core_free(void *bp, size_t size);
+static void *core_realloc(void *bp, size_t size);
+static void *core_memalign(size_t align, size_t size);
+static void *align_extend(size_t align, size_t asize);
+static size_t core_malloc_batch(size_t size, size_t n, void **ptrs);
+static void core_free_batch(void **ptrs, size_t n);
+static int ptr_cmp(const void *a, const void *b);
+static int arena_init(void);
+#if MM_THREADS
+static void arena_setup(void);
+static int arena_get(void);
+static int arena_lock(int k);
+static int arena_use(int k);
+static void remote_free(int k, void *bp);
+static void remote_drain(int k);
+static int tcache_class(size_t size);
+static char *tcache_get(void);
+static void *tcache_alloc(size_t size);
+static int tcache_free(void *bp, size_t size);
+static void tcache_drain(char *cache, int i, int n);
+static void tcache_flush(void *cache);
+#endif
+static void *map_alloc(size_t size);
+static void map_free(void *bp);
+static void *map_realloc(void *bp, size_t size);
+static void free_block(void *bp);
+static void quick_flush(char *head);
+static void quick_flush_all(void);
 static void *extend_heap(size_t words);
+static void zero_claim(char *bp);
 static void *coalesce(void *bp);
+static void purge(int now);
+static void purge_block(char *bp, int now);
+static void purge_index(int now);
 static void *find_fit(size_t asize);
 static void place(void *bp, size_t asize);
+static void place_batch(char *bp, size_t asize, size_t n, void **ptrs);
 static void insert(void* bp);
 static void delete(void* bp);
+#if TLSF
+static void mapping_insert(size_t asize, int *fl, int *sl);
+static void mapping_search(size_t asize, int *fl, int *sl);
+#else
 static int get_size_class(size_t asize);
-static int is_list_ptr(void *ptr);
+static int skip_level(char *bp);
+static void skip_insert(char *bp, int i);
+static void skip_delete(char *bp);
+static char *splay(char *t, size_t size, char *addr);
+static void tree_insert(void *bp);
+static void tree_delete(void *bp);
+static void *tree_find_fit(size_t asize);
+static void tree_purge(char *t, int now);
+#endif
+static void *slab_alloc(int slab_class);
+static void slab_free(void *p);
+static char *slab_create(int slab_class);
+static void slab_link(char *s, int slab_class);
+static void slab_unlink(char *s, int slab_class);
 static void print_block(void *bp);
 static void print_heap();
 static void check_block(void *bp);
+static void check_quick();
+static void check_free_size(void *bp, size_t size);
 
 
 /*
@@ -111,19 +555,23 @@ static void check_block(void *bp);
 static void print_block(void *bp) {
     printf("\tp: %p; ", bp);
     printf("allocated: %s; ", GET_ALLOC(HDRP(bp))? "yes": "no" );
+    printf("prev allocated: %s; ", GET_PREV_ALLOC(HDRP(bp))? "yes": "no" );
     printf("hsize: %d; ", GET_SIZE(HDRP(bp)));
-    printf("fsize: %d; ", GET_SIZE(FTRP(bp)));
-    printf("pred: %p, succ: %p\n", (void *) GET(PRED(bp)), (void *) GET(SUCC(bp)));
+    if (!GET_ALLOC(HDRP(bp)))
+        printf("fsize: %d; ", GET_SIZE(FTRP(bp)));
+    printf("pred: %#x, succ: %#x\n", GET(PRED(bp)), GET(SUCC(bp)));
 }
 
 /*
- * check alignment and header/footer consistency of a block
+ * check alignment, header/footer consistency and the prev-allocated bit of a block
  */
 static void check_block(void *bp) {
     if (GET_SIZE(HDRP(bp)) % DSIZE)
         printf("\terror: not doubly aligned\n");
-    if (GET(HDRP(bp)) != GET(FTRP(bp)))
+    if (!GET_ALLOC(HDRP(bp)) && GET_SIZE(HDRP(bp)) != GET_SIZE(FTRP(bp)))
         printf("\terror: header & foot do not match\n");
+    if (!GET_PREV_ALLOC(HDRP(NEXT_BLKP(bp))) != !GET_ALLOC(HDRP(bp)))
+        printf("\terror: prev allocated bit of next block is stale\n");
 }
 
 /*
@@ -142,25 +590,135 @@ static void print_heap() {
 /*
  * print info of the segregated free list maintained on the heap
  */
+#if TLSF
+static void check_list() {
+    void *bp;
+    int fl, sl;
+    printf("\tTLSF Free List Info (fl bitmap: %#x):\n", GET(FL_BITMAP));
+    for (fl = 0; fl < FL_COUNT; fl++) {
+        for (sl = 0; sl < SL_COUNT; sl++) {
+            bp = GET_PTR(TLSF_HEAD(fl, sl));
+            if (bp == ((void *) 0))
+                continue;
+            printf("\t\tlist (%d, %d): not empty\n", fl, sl);
+            while (bp != ((void *) 0)) {
+                print_block(bp);
+                bp = SUCC_BLKP(bp);
+            }
+        }
+    }
+    printf("\n");
+}
+#else
+/*
+ * print the blocks of a subtree in ascending key order
+ */
+static void print_tree(void *bp) {
+    if (bp == ((void *) 0))
+        return;
+    print_tree(LEFT_BLKP(bp));
+    print_block(bp);
+    print_tree(RIGHT_BLKP(bp));
+}
+
 static void check_list() {
     void *size_class_ptr, *bp;
+    int rover_found;
     printf("\tSegregated Free List Info:\n");
     for (int i = 0; i < NUM_SIZE_CLASS; i++) {
-        size_class_ptr = freelist_p + i;
-        if (GET(size_class_ptr) == 0) {
+        size_class_ptr = CLASS_HEAD(i);
+        rover_found = 0;
+        if (size_class_ptr == TREE_ROOT) {
+            if (GET(size_class_ptr) == 0) {
+                printf("\t\tsize class %d (tree): empty\n", i);
+            } else {
+                printf("\t\tsize class %d (tree): not empty\n", i);
+                print_tree(GET_PTR(size_class_ptr));
+            }
+        } else if (LIST_SUCC(size_class_ptr) == (char *) size_class_ptr) {
             printf("\t\tsize class %d: empty\n", i);
         } else {
             printf("\t\tsize class %d: not empty\n", i);
-            bp = (void *) GET(size_class_ptr);
-            while (bp != ((void *) 0)) {
+            for (bp = LIST_SUCC(size_class_ptr); bp != size_class_ptr; bp = LIST_SUCC(bp)) {
                 print_block(bp);
-                bp = SUCC_BLKP(bp);
+                rover_found |= (FIT_POLICY == FIT_NEXT && GET(ROVER(i)) == TO_OFFSET(bp));
+                if (LIST_PRED(LIST_SUCC(bp)) != (char *) bp)
+                    printf("Error: pred of the next block is not this one\n");
+                if (policy == MM_ADDRESS_ORDER && LIST_SUCC(bp) != size_class_ptr
+                        && LIST_SUCC(bp) < (char *) bp)
+                    printf("Error: list out of address order\n");
             }
         }
+        if (FIT_POLICY == FIT_NEXT && size_class_ptr != TREE_ROOT && !rover_found
+                && GET(ROVER(i)) != TO_OFFSET(size_class_ptr))
+            printf("Error: rover of size class %d is not on its list\n", i);
+    }
+    printf("\n");
+}
+#endif
+
+/*
+ * print the slabs with free slots of each class and check their counts
+ */
+static void check_slabs() {
+    char *s, *map;
+    unsigned int nfree;
+    printf("\tSlab Info:\n");
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        for (s = GET_PTR(SLAB_HEAD(i)); s != NULL; s = GET_PTR(SLAB_NEXT(s))) {
+            printf("\t\tclass %d slab %p: %u of %u free\n", i, s,
+                    GET(SLAB_NFREE(s)), GET(SLAB_NOBJ(s)));
+            if (!IS_SLAB(s))
+                printf("\terror: slab missing from the page bitmap\n");
+            nfree = 0;
+            for (map = SLAB_BITMAP(s); map < SLAB_BITMAP(s) + WSIZE*((GET(SLAB_NOBJ(s)) + 31) / 32); map += WSIZE)
+                nfree += __builtin_popcount(GET(map));
+            if (nfree != GET(SLAB_NFREE(s)) || nfree == 0)
+                printf("\terror: free count does not match the bitmap\n");
+        }
     }
     printf("\n");
 }
 
+/*
+ * check that every parked block is allocated, at least of the size of its list,
+ * and that the lengths stored along each list count down to one
+ */
+static void check_quick() {
+    char *bp;
+    size_t asize;
+    for (asize = SLAB_MAX_SIZE + DSIZE; asize <= QUICK_MAX_SIZE; asize += DSIZE) {
+        for (bp = GET_PTR(QUICK_HEAD(asize)); bp != NULL; bp = GET_PTR(QUICK_NEXT(bp))) {
+            if (!GET_ALLOC(HDRP(bp)) || GET_SIZE(HDRP(bp)) < asize)
+                printf("\terror: parked block %p is free or too small\n", bp);
+            if (GET(QUICK_LEN(bp)) != (GET(QUICK_NEXT(bp)) ? GET(QUICK_LEN(GET_PTR(QUICK_NEXT(bp)))) + 1 : 1))
+                printf("\terror: parked block %p has a wrong list length\n", bp);
+        }
+    }
+}
+
+/*
+ * abort if size cannot be the last size requested for the allocated block bp
+ */
+static void check_free_size(void *bp, size_t size) {
+    size_t asize;
+    // realloc shrinks a slab object in place, so its slot may be larger
+    if (IS_SLAB(bp)) {
+        if (size > GET(SLAB_OBJ_SIZE(SLAB_OF(bp)))) {
+            printf("\terror: %p freed with size %zu, slab of %u-byte objects\n",
+                    bp, size, GET(SLAB_OBJ_SIZE(SLAB_OF(bp))));
+            abort();
+        }
+        return;
+    }
+    asize = MAX(MIN_BLOCK_SIZE, DSIZE * ((size + WSIZE + (DSIZE-1)) / DSIZE));
+    if (!GET_ALLOC(HDRP(bp)) || GET_SIZE(HDRP(bp)) < asize) {
+        printf("\terror: %p freed with size %zu, header says %u%s\n", bp, size,
+                GET_SIZE(HDRP(bp)), GET_ALLOC(HDRP(bp)) ? "" : " and free");
+        abort();
+    }
+}
+
 /*
  * Heap consistency checker
  */
@@ -181,6 +739,8 @@ int mm_check() {
 
     // check list
     check_list();
+    check_slabs();
+    check_quick();
     return 0;
 }
 
@@ -189,10 +749,60 @@ int mm_check() {
  * mm_init - initialize the malloc package.
  */
 int mm_init(void)
+{
+    // the heap size is set at run time, but a region must stay within
+    // reach of 32-bit offsets
+    if (mem_region_span() > ((size_t) 1 << 32))
+        return -1;
+    heap_base = mem_heap_lo();
+    region_shift = __builtin_ctzl(mem_region_span());
+#if MM_THREADS
+    // no other thread may be inside the package while the heap is reset
+    pthread_once(&arena_once, arena_setup);
+    heap_epoch++;
+    next_arena = 1;
+    thread_arena = 0;
+    num_arenas = MIN(MEM_REGIONS, ((size_t) 1 << 32) >> region_shift);
+#endif
+    // the lists are empty, so they may change their order
+    policy = next_policy;
+    if (FIT_STATS)
+        fit_calls = fit_probes = 0;
+    cur_arena = 0;
+    return arena_init();
+}
+
+/*
+ * mm_set_policy - keep the segregated lists in LIFO (MM_LIFO) or address
+ * order (MM_ADDRESS_ORDER) from the next mm_init on
+ */
+void mm_set_policy(int p)
+{
+    next_policy = p;
+}
+
+/*
+ * mm_fit_stats - report how many free-block searches the calling thread
+ * made since mm_init and how many blocks they looked at; a look-up of
+ * the tree or of a TLSF list counts as one
+ * returns -1 if the package was built without FIT_STATS, which counts nothing
+ */
+int mm_fit_stats(unsigned long *calls, unsigned long *probes)
+{
+    *calls = fit_calls;
+    *probes = fit_probes;
+    return FIT_STATS ? 0 : -1;
+}
+
+/*
+ * arena_init - create the index, prologue, epilogue and first free block
+ * of the current arena in its empty region
+ */
+static int arena_init(void)
 {
     // create initial empty heap, no alignment padding needed
-    // array (13 * 4) + prologue (2 * 4) + epilogue (4)
-    if ((heap_listp = mem_sbrk(WSIZE*(NUM_SIZE_CLASS + 2 + 1))) == (void *) -1)
+    // index (INDEX_WORDS * 4) + prologue (2 * 4) + epilogue (4)
+    if ((heap_listp = mem_region_sbrk(cur_arena, WSIZE*(INDEX_WORDS + 2 + 1))) == (void *) -1)
         return -1;
 
     // first, initialize an array of pointers (with initial value 0)
@@ -201,18 +811,37 @@ int mm_init(void)
     // size here means adjusted size.
     // minimum size of a size class is 16 bytes
 
-    /* there are 17 size classes
-     * [1-2^4], [2^4+1 - 2^5] ... [2^18+1, 2^19], [2^19+1 - +inf]
+    /* by default there are 12 size classes
+     * [1-2^4], [2^4+1 - 2^5] ... [2^13+1, 2^14], [2^14+1 - +inf]
+     * (SIZE_CLASS_LIMITS sets the bounds of all but the last two)
+     * the head of the last one is the root of the tree of large blocks,
+     * which FIT_NEXT follows with a rover for each list
+     *
+     * with TLSF the area instead holds the first-level bitmap, one
+     * second-level bitmap per first level and FL_COUNT * SL_COUNT heads
+     *
+     * either is followed by SLAB_CLASSES heads of slab lists
      */
 
-    memset(heap_listp, 0, NUM_SIZE_CLASS*WSIZE);
-    freelist_p = (char **) heap_listp;
+    memset(heap_listp, 0, INDEX_WORDS*WSIZE);
+    memset(slab_map[cur_arena], 0, slab_map_top[cur_arena]*WSIZE);
+    slab_map_top[cur_arena] = 0;
+    freelist_p = heap_listp + WSIZE;
+#if !TLSF
+    // an empty list is a sentinel linked to itself
+    for (int i = 0; i < NUM_SIZE_CLASS-1; i++) {
+        PUT(PRED(CLASS_HEAD(i)), TO_OFFSET(CLASS_HEAD(i)));
+        PUT(SUCC(CLASS_HEAD(i)), TO_OFFSET(CLASS_HEAD(i)));
+        if (FIT_POLICY == FIT_NEXT)
+            PUT(ROVER(i), TO_OFFSET(CLASS_HEAD(i)));
+    }
+#endif
 
     // next, initialize the prologue and epilogue block
-    heap_listp += NUM_SIZE_CLASS * WSIZE;
-    PUT(heap_listp, PACK(DSIZE, 1)); // prologue header
+    heap_listp += INDEX_WORDS * WSIZE;
+    PUT(heap_listp, PACK(DSIZE, 1) | PREV_ALLOC); // prologue header
     PUT(heap_listp + (1*WSIZE), PACK(DSIZE, 1)); // prologue footer
-    PUT(heap_listp + (2*WSIZE), PACK(0, 1)); // epilogue header
+    PUT(heap_listp + (2*WSIZE), PACK(0, 1) | PREV_ALLOC); // epilogue header
     heap_listp += (1*WSIZE); // set heap_listp as block pointer to prologue block
 
     // extend the empty heap with a free block of CHUNKSIZE bytes
@@ -223,10 +852,295 @@ int mm_init(void)
     return 0;
 }
 
-/* 
- * mm_malloc - adjust the size and allocate a block of that size from the free list
+/*
+ * mm_malloc - allocate from the thread cache if possible, otherwise from
+ * the arena of the thread
  */
 void *mm_malloc(size_t size)
+{
+    // huge requests never touch the arenas
+    if (size >= MMAP_THRESHOLD)
+        return map_alloc(size);
+#if MM_THREADS
+    void *bp;
+    int k = arena_get();
+    // taking the mutex drains blocks other threads freed into the arena,
+    // which exists once the thread has a cache in it
+    if (tcache_p != NULL && tcache_epoch == heap_epoch
+            && __atomic_load_n(REMOTE_COUNT(k), __ATOMIC_RELAXED) >= TCACHE_BATCH
+            && LOCK(k) == 0)
+        UNLOCK();
+    if ((bp = tcache_alloc(size)) != NULL)
+        return bp;
+    if (LOCK(arena_get()) < 0)
+        return NULL;
+    bp = core_malloc(size);
+    UNLOCK();
+    return bp;
+#else
+    return core_malloc(size);
+#endif
+}
+
+/*
+ * mm_calloc - allocate a cleared array of nmemb elements of size bytes;
+ * memory that has never been used since it came from memlib is not
+ * cleared again
+ */
+void *mm_calloc(size_t nmemb, size_t size)
+{
+    size_t bytes;
+
+    if (size != 0 && nmemb > (size_t) -1 / size)
+        return NULL;
+    bytes = nmemb * size;
+    // a fresh mapping reads as zero
+    if (bytes >= MMAP_THRESHOLD)
+        return map_alloc(bytes);
+#if MM_THREADS
+    void *bp;
+    if ((bp = tcache_alloc(bytes)) != NULL) {
+        memset(bp, 0, bytes);
+        return bp;
+    }
+    if (LOCK(arena_get()) < 0)
+        return NULL;
+    bp = core_calloc(bytes);
+    UNLOCK();
+    return bp;
+#else
+    return core_calloc(bytes);
+#endif
+}
+
+/*
+ * mm_free - free a block of unknown size
+ */
+void mm_free(void *bp)
+{
+    mm_free_sized(bp, 0);
+}
+
+/*
+ * mm_free_sized - return a block to the thread cache if it has room, otherwise
+ * to the arena that owns it, through its remote-free queue if that is
+ * not the arena of the thread
+ * size is the size last requested for the block, or 0 if unknown; a small
+ * block of known size is classified without reading its header
+ */
+void mm_free_sized(void *bp, size_t size)
+{
+    if (bp == NULL)
+        return;
+    if (IS_MAPPED(bp)) {
+        map_free(bp);
+        return;
+    }
+#if MM_THREADS
+    int k = REGION_OF(bp);
+    // the owner of the block may be changing the flag bits of its header
+    if (DEBUG_FREE_SIZE && size > 0 && LOCK(k) == 0) {
+        check_free_size(bp, size);
+        UNLOCK();
+    }
+    if (tcache_free(bp, size))
+        return;
+    if (k != arena_get()) {
+        remote_free(k, bp);
+        return;
+    }
+    LOCK(k);
+    core_free(bp, size);
+    UNLOCK();
+#else
+    if (DEBUG_FREE_SIZE && size > 0)
+        check_free_size(bp, size);
+    core_free(bp, size);
+#endif
+}
+
+/*
+ * mm_realloc - resize a block in the arena that owns it, or remap it if
+ * it is a mapping of its own
+ */
+void *mm_realloc(void *bp, size_t size)
+{
+    if (bp != NULL && IS_MAPPED(bp))
+        return map_realloc(bp, size);
+#if MM_THREADS
+    void *newbp;
+    if (bp == NULL)
+        return mm_malloc(size);
+    if (size == 0) {
+        mm_free(bp);
+        return NULL;
+    }
+    LOCK(REGION_OF(bp));
+    newbp = core_realloc(bp, size);
+    UNLOCK();
+    return newbp;
+#else
+    return core_realloc(bp, size);
+#endif
+}
+
+/*
+ * mm_memalign - allocate a block whose payload is a multiple of align,
+ * a power of two, from the arena of the thread
+ */
+void *mm_memalign(size_t align, size_t size)
+{
+    if (align == 0 || (align & (align - 1)) != 0)
+        return NULL;
+    // every payload is ALIGNMENT-aligned already
+    if (align <= ALIGNMENT)
+        return mm_malloc(size);
+#if MM_THREADS
+    void *bp;
+    if (LOCK(arena_get()) < 0)
+        return NULL;
+    bp = core_memalign(align, size);
+    UNLOCK();
+    return bp;
+#else
+    return core_memalign(align, size);
+#endif
+}
+
+/*
+ * mm_aligned_alloc - C11 aligned_alloc, the same as mm_memalign
+ */
+void *mm_aligned_alloc(size_t align, size_t size)
+{
+    return mm_memalign(align, size);
+}
+
+/*
+ * mm_usable_size - return the number of bytes the caller may use in an
+ * allocated block, which is at least the size it was requested with
+ */
+size_t mm_usable_size(void *bp)
+{
+    if (bp == NULL)
+        return 0;
+    // the header of a mapping holds the size of the whole mapping
+    if (IS_MAPPED(bp))
+        return GET_SIZE(HDRP(bp)) - DSIZE;
+    if (IS_SLAB(bp))
+        return GET(SLAB_OBJ_SIZE(SLAB_OF(bp)));
+    // an allocated block has no footer
+    return GET_SIZE(HDRP(bp)) - WSIZE;
+}
+
+/*
+ * mm_good_size - return the usable size of a block mm_malloc returns for a
+ * request of size bytes, or 0 if it returns none; asking for that much
+ * instead costs no more memory
+ */
+size_t mm_good_size(size_t size)
+{
+    size_t page = mem_pagesize();
+
+    if (size == 0 || size > MAX_REQUEST)
+        return 0;
+    if (size >= MMAP_THRESHOLD)
+        return ((size + DSIZE + page - 1) & ~(page - 1)) - DSIZE;
+    if (size <= SLAB_MAX_SIZE)
+        return DSIZE * ((size + DSIZE-1) / DSIZE);
+    return DSIZE * ((size + WSIZE + (DSIZE-1)) / DSIZE) - WSIZE;
+}
+
+/*
+ * mm_malloc_batch - allocate n blocks of size bytes into ptrs under one
+ * lock, carving them out of one free block where possible; returns the
+ * number of blocks allocated, which is less than n only if memory ran out
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **ptrs)
+{
+    size_t i = 0;
+
+    if (size >= MMAP_THRESHOLD) {
+        while (i < n && (ptrs[i] = map_alloc(size)) != NULL)
+            i++;
+        return i;
+    }
+#if MM_THREADS
+    if (LOCK(arena_get()) < 0)
+        return 0;
+    i = core_malloc_batch(size, n, ptrs);
+    UNLOCK();
+    return i;
+#else
+    return core_malloc_batch(size, n, ptrs);
+#endif
+}
+
+/*
+ * mm_free_batch - free the n blocks in ptrs, which is left sorted by address
+ * blocks that lie next to each other in the heap are merged into one free
+ * block before it is coalesced and indexed, and each arena is locked once
+ */
+void mm_free_batch(void **ptrs, size_t n)
+{
+    size_t i, j;
+
+    qsort(ptrs, n, sizeof(void *), ptr_cmp);
+    for (i = 0; i < n; i = j) {
+        j = i + 1;
+        if (ptrs[i] == NULL)
+            continue;
+        if (IS_MAPPED(ptrs[i])) {
+            map_free(ptrs[i]);
+            continue;
+        }
+#if MM_THREADS
+        int k = REGION_OF(ptrs[i]);
+        while (j < n && !IS_MAPPED(ptrs[j]) && REGION_OF(ptrs[j]) == k)
+            j++;
+        if (k != arena_get()) {
+            for (; i < j; i++)
+                remote_free(k, ptrs[i]);
+            continue;
+        }
+        LOCK(k);
+        core_free_batch(ptrs + i, j - i);
+        UNLOCK();
+#else
+        while (j < n && !IS_MAPPED(ptrs[j]))
+            j++;
+        core_free_batch(ptrs + i, j - i);
+#endif
+    }
+}
+
+/*
+ * mm_trim - give all large free blocks back to memlib right away,
+ * instead of when they have stayed free for a while
+ */
+void mm_trim(void)
+{
+#if MM_THREADS
+    int i, k;
+    // blocks cached by the calling thread count as allocated, so they
+    // go back to the arena first
+    if (tcache_p != NULL && tcache_epoch == heap_epoch)
+        for (i = 0; i < TCACHE_CLASSES; i++)
+            tcache_drain(tcache_p, i, TCACHE_LIMIT);
+    for (k = 0; k < MEM_REGIONS; k++) {
+        pthread_mutex_lock(&arena_mutex[k]);
+        if (mem_region_size(k) > 0 && arena_use(k) == 0)
+            purge(1);
+        pthread_mutex_unlock(&arena_mutex[k]);
+    }
+#else
+    purge(1);
+#endif
+}
+
+/* 
+ * core_malloc - adjust the size and allocate a block of that size from the free list
+ */
+static void *core_malloc(size_t size)
 {
     if (DEBUG_MALLOC) {
         printf("before malloc\n");
@@ -234,29 +1148,31 @@ void *mm_malloc(size_t size)
     }
 
     size_t asize; // adjusted block size
-    size_t extendsize; // the amount to extend the heap by if there's no fit
     char *bp;
 
-    // ignore non-positive values
-    if (size <= 0)
+    // ignore non-positive values and sizes a header cannot describe
+    if (size <= 0 || size > MAX_REQUEST)
         return NULL;
 
-    // adjust block size to include overhead and satisfy 8-byte alignment
-    if (size <= DSIZE) {
-        asize = 2*DSIZE;
+    // small objects come from a slab of their class
+    if (size <= SLAB_MAX_SIZE)
+        return slab_alloc((size - 1) / DSIZE);
+
+    // adjust block size to include the header and satisfy 8-byte alignment
+    if (size <= MIN_BLOCK_SIZE - WSIZE) {
+        asize = MIN_BLOCK_SIZE;
     } else {
-        asize = DSIZE * ((size + DSIZE + (DSIZE-1)) / DSIZE);
+        asize = DSIZE * ((size + WSIZE + (DSIZE-1)) / DSIZE);
     }
 
-    // search the free list for a fit
-    if ((bp = find_fit(asize)) != NULL) {
-        place(bp, asize);
+    // a recently freed block of the same size is taken back as it is
+    if (IS_QUICK_SIZE(asize) && (bp = GET_PTR(QUICK_HEAD(asize))) != NULL) {
+        PUT(QUICK_HEAD(asize), GET(QUICK_NEXT(bp)));
+        PUT(HDRP(bp), GET(HDRP(bp)) & ~GROWN);
         return bp;
     }
 
-    // no fit found. extend the heap and place
-    extendsize = MAX(asize, CHUNKSIZE);
-    if ((bp = extend_heap(extendsize/WSIZE)) == NULL)
+    if ((bp = fit_or_extend(asize)) == NULL)
         return NULL;
     place(bp, asize);
 
@@ -270,147 +1186,702 @@ void *mm_malloc(size_t size)
 }
 
 /*
- * mm_free - Freeing a block by setting the header/footer and coalescing
+ * find a free block of at least asize bytes: search the free list for a
+ * fit, and once more after coalescing the parked blocks, before the heap
+ * is extended by a block that fits
+ * the free block ending the heap, the wilderness, is taken last, as it
+ * is the only one that can grow without moving anything
  */
-void mm_free(void *bp)
+static void *fit_or_extend(size_t asize)
 {
-    if (DEBUG_FREE) {
-        printf("before free %p\n", bp);
-        print_heap();
-    }
+    char *bp, *other;
 
-    size_t size = GET_SIZE(HDRP(bp));
-    PUT(HDRP(bp), PACK(size, 0));
-    PUT(FTRP(bp), PACK(size, 0));
-    // zero out the pred/succ to be safe
-    PUT(PRED(bp), 0);
-    PUT(SUCC(bp), 0);
-    insert(coalesce(bp));
+    if ((bp = find_fit(asize)) == NULL &&
+            (quick_flush_all(), bp = find_fit(asize)) == NULL)
+        return grow_heap(asize);
 
-    if (DEBUG_FREE) {
-        printf("after free %p\n", bp);
-        print_heap();
+    if (GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0) {
+        delete(bp);
+        other = find_fit(asize);
+        insert(bp);
+        if (other == NULL)
+            return bp;
+        bp = other;
     }
+    // a hole was reused, so the heap is no longer growing fast
+    if (GET(GROW_RUN) != 0)
+        PUT(GROW_RUN, 0);
+    return bp;
 }
 
 /*
- * mm_realloc - only free and malloc when necessary
- * coalescing strategy is used when expanding the block size
+ * extend the heap so that its last block is a free block of at least
+ * asize bytes, and return that block
+ * a free block ending the heap only needs what it lacks; when the heap
+ * keeps growing, it grows by steps that double from CHUNKSIZE on, so
+ * that a growing heap calls mem_sbrk less and less often
  */
-void *mm_realloc(void *bp, size_t size)
+static void *grow_heap(size_t asize)
 {
-    // bp is NULL, equivalent to malloc call
-    if (bp == NULL) {
-       return mm_malloc(size);
+    char *bp = (char *) mem_region_hi(cur_arena) + 1; // payload position after the epilogue
+    size_t size = 0, grow;
+    unsigned int run = GET(GROW_RUN);
+
+    if (!GET_PREV_ALLOC(HDRP(bp))) {
+        bp = PREV_BLKP(bp);
+        size = GET_SIZE(HDRP(bp));
     }
+    // the TLSF search skips a block that fits but lies in a smaller range
+    if (size >= asize)
+        return bp;
 
-    // size is 0, equivalent to free
-    if (size == 0) {
-        mm_free(bp);
+    grow = asize - size;
+    if (run >= GROW_SLOW)
+        grow = MAX(grow, MIN((size_t) CHUNKSIZE << MIN(run - GROW_SLOW, 16), GROW_MAX));
+    PUT(GROW_RUN, MIN(run + 1, GROW_SLOW + 16));
+    return extend_heap(grow/WSIZE);
+}
+
+/*
+ * core_calloc - allocate a block of size bytes like core_malloc and clear
+ * it, except for the part taken from the end of the heap that is known to
+ * read as zero already
+ */
+static void *core_calloc(size_t size)
+{
+    size_t asize;
+    char *bp, *zero, *ftr;
+
+    if (size == 0 || size > MAX_REQUEST)
         return NULL;
+    if (size <= MIN_BLOCK_SIZE - WSIZE)
+        asize = MIN_BLOCK_SIZE;
+    else
+        asize = DSIZE * ((size + WSIZE + (DSIZE-1)) / DSIZE);
+
+    // slab objects and parked blocks are reused memory
+    if (size <= SLAB_MAX_SIZE ||
+            (IS_QUICK_SIZE(asize) && GET(QUICK_HEAD(asize)) != 0)) {
+        if ((bp = core_malloc(size)) != NULL)
+            memset(bp, 0, size);
+        return bp;
     }
 
-    size_t old_size = GET_SIZE(HDRP(bp));
-    size_t asize, nextblc_size, copy_size;
-    void *oldbp = bp;
-    void *newbp;
+    if ((bp = fit_or_extend(asize)) == NULL)
+        return NULL;
+    zero = GET_PTR(ZERO_FROM);
+    ftr = FTRP(bp);
+    place(bp, asize);
 
-    // check whether realloc is shrinking or expanding
-    // get the adjusted size of the request
-    if (size <= DSIZE) {
-        asize = 2*DSIZE;
+    if (zero <= bp || zero >= ftr || zero >= bp + size) {
+        memset(bp, 0, size);
     } else {
-        asize = DSIZE * ((size + DSIZE + (DSIZE-1)) / DSIZE);
+        // the block may end in the old footer, the one word past it
+        memset(bp, 0, zero - bp);
+        if (ftr < bp + size)
+            memset(ftr, 0, bp + size - ftr);
     }
+    return bp;
+}
 
-    // if the same size
-    if (asize == old_size) {
-        return bp;
+/*
+ * core_free - Freeing a block by setting the header/footer and coalescing
+ * a known request size, or 0, spares reading the header of a small block
+ */
+static void core_free(void *bp, size_t size)
+{
+    if (DEBUG_FREE) {
+        printf("before free %p\n", bp);
+        print_heap();
     }
-    // if shrinking
-    if (asize < old_size) {
-        // we split the block if the remainder is big enough
-        if (old_size - asize >= MIN_BLOCK_SIZE) {
-            // shrink the old block
-            PUT(HDRP(bp), PACK(asize, 1));
-            PUT(FTRP(bp), PACK(asize, 1));
-            // construct the new block
-            newbp = NEXT_BLKP(bp);
-            PUT(HDRP(newbp), PACK(old_size - asize, 0));
-            PUT(FTRP(newbp), PACK(old_size - asize, 0));
-            // insert new block into free list
-            // zero out pred/succ to be safe
-            PUT(PRED(newbp), 0);
-            PUT(SUCC(newbp), 0);
-            insert(newbp);
-        }
-        // otherwise we don't do anything
-        return oldbp;
+
+    // free memory that stays unused for a while is given back
+    PUT(PURGE_CLOCK, GET(PURGE_CLOCK) + 1);
+    if (GET(PURGE_CLOCK) >= PURGE_INTERVAL)
+        purge(0);
+
+    // objects of a slab have no header, and are never larger than a slab class
+    if (size <= SLAB_MAX_SIZE && IS_SLAB(bp)) {
+        slab_free(bp);
+        return;
     }
 
-    // if expanding
-    else {
-        // we check if we can make the block large enough by
-        // coalescing with the block to its right
-        nextblc_size = GET_SIZE(HDRP(NEXT_BLKP(bp)));
-        if (!GET_ALLOC(HDRP(NEXT_BLKP(bp)))) {
-            if (nextblc_size + old_size >= asize) {
-                // we coalesce
-                // first, delete the next block from free list
-                delete(NEXT_BLKP(bp));
-                // then we construct a large allocated block
-                PUT(HDRP(bp), PACK(old_size + nextblc_size, 1));
-                PUT(FTRP(bp), PACK(old_size + nextblc_size, 1));
-                return oldbp;
-            }
-        }
+    // a small block is parked, still allocated, until its list overflows;
+    // a block realloc left larger than its size is parked by its size
+    size_t asize = size ? DSIZE * ((size + WSIZE + (DSIZE-1)) / DSIZE) : GET_SIZE(HDRP(bp));
+    if (IS_QUICK_SIZE(asize)) {
+        char *head = QUICK_HEAD(asize);
+        char *next = GET_PTR(head);
+        unsigned int len = next ? GET(QUICK_LEN(next)) + 1 : 1;
+        PUT(QUICK_NEXT(bp), GET(head));
+        PUT(QUICK_LEN(bp), len);
+        PUT(head, TO_OFFSET(bp));
+        if (len >= QUICK_LIMIT)
+            quick_flush(head);
+    } else {
+        free_block(bp);
+    }
 
-        // coalescing with the left won't do any good because
-        // everything still needs to be copied over so in all
-        // other cases, we free the current block and allocate
-        // a new block and copy everything over
-        newbp = mm_malloc(size);
-        copy_size = old_size - DSIZE;
-        memcpy(newbp, oldbp, copy_size);
-        mm_free(bp);
-        return newbp;
+    if (DEBUG_FREE) {
+        printf("after free %p\n", bp);
+        print_heap();
     }
 }
 
 /*
- * Extend the heap by a given number of words
+ * core_memalign - find a free block that holds an aligned block of size
+ * bytes, or extend the heap by one; the space in front of the aligned
+ * payload becomes a free block of its own
+ * an aligned block always has a header, even if it is small enough for a slab
  */
-static void *extend_heap(size_t words) {
-    char *bp;
-    size_t size; // in bytes
-
-    // allocate an even number of words to maintain double-word alignment
-    size = (words % 2) ? (words+1) * WSIZE : words * WSIZE;
-    if ((long) (bp = mem_sbrk(size)) == -1)
-        return NULL; // extension failed
+static void *core_memalign(size_t align, size_t size)
+{
+    size_t asize, need, csize, gap;
+    char *bp, *p;
 
-    // extension successful, bp now points to the first byte after allocated space
-    // initialize free block header/footer and epilogue header
-    // pred/succ are handled by insert call below
-    PUT(HDRP(bp), PACK(size, 0)); // must populate header first
-    PUT(FTRP(bp), PACK(size, 0)); // footer uses header size info
-    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); // new epilogue
+    if (size == 0 || size > MAX_REQUEST || align > MAX_REQUEST)
+        return NULL;
+    if (size <= MIN_BLOCK_SIZE - WSIZE)
+        asize = MIN_BLOCK_SIZE;
+    else
+        asize = DSIZE * ((size + WSIZE + (DSIZE-1)) / DSIZE);
+
+    // the gap in front of the payload is either empty or a whole block,
+    // so it is less than align + MIN_BLOCK_SIZE
+    need = asize + align + MIN_BLOCK_SIZE;
+    if (need > MAX_REQUEST)
+        return NULL;
+    // the block that fits asize best may happen to hold an aligned block,
+    // otherwise take one that holds it wherever it starts
+    if ((bp = find_fit(asize)) == NULL ||
+            GET_SIZE(HDRP(bp)) < ALIGN_GAP(bp, align) + asize) {
+        if ((bp = find_fit(need)) == NULL &&
+                (quick_flush_all(), bp = find_fit(need)) == NULL &&
+                (bp = align_extend(align, asize)) == NULL)
+            return NULL;
+    }
+    p = bp + ALIGN_GAP(bp, align);
+
+    if (p != bp) {
+        // give the gap back as a free block in front of the aligned one
+        csize = GET_SIZE(HDRP(bp));
+        gap = p - bp;
+        delete(bp);
+        PUT(HDRP(bp), PACK(gap, 0) | GET_PREV_ALLOC(HDRP(bp)));
+        PUT(FTRP(bp), PACK(gap, 0));
+        insert(bp);
+        PUT(HDRP(p), PACK(csize - gap, 0));
+        PUT(FTRP(p), PACK(csize - gap, 0));
+        insert(p);
+    }
+    place(p, asize);
+    return p;
+}
+
+/*
+ * extend the heap by what the free block ending it lacks to hold an
+ * aligned block of asize bytes, and return that block
+ */
+static void *align_extend(size_t align, size_t asize)
+{
+    char *bp = (char *) mem_region_hi(cur_arena) + 1; // payload position after the epilogue
+    size_t size = 0;
+
+    if (!GET_PREV_ALLOC(HDRP(bp))) {
+        bp = PREV_BLKP(bp);
+        size = GET_SIZE(HDRP(bp));
+    }
+    if (size >= ALIGN_GAP(bp, align) + asize)
+        return bp;
+    return extend_heap((ALIGN_GAP(bp, align) + asize - size) / WSIZE);
+}
+
+/*
+ * core_malloc_batch - allocate n blocks of the same size: parked blocks of
+ * that size first, then the rest carved in one go out of a free block or
+ * a heap extension that holds them all
+ */
+static size_t core_malloc_batch(size_t size, size_t n, void **ptrs)
+{
+    size_t asize, need, k, i = 0;
+    char *bp;
+
+    if (size == 0 || size > MAX_REQUEST)
+        return 0;
+
+    if (size > SLAB_MAX_SIZE) {
+        asize = DSIZE * ((size + WSIZE + (DSIZE-1)) / DSIZE);
+
+        if (IS_QUICK_SIZE(asize)) {
+            while (i < n && (bp = GET_PTR(QUICK_HEAD(asize))) != NULL) {
+                PUT(QUICK_HEAD(asize), GET(QUICK_NEXT(bp)));
+                PUT(HDRP(bp), GET(HDRP(bp)) & ~GROWN);
+                ptrs[i++] = bp;
+            }
+        }
+
+        while (i < n) {
+            // take the longest run a free block holds, halving it down to
+            // one block, so that holes are used before the heap grows
+            for (k = MIN(n - i, MAX_REQUEST / asize); k > 0; k /= 2)
+                if ((bp = find_fit(k * asize)) != NULL)
+                    break;
+            if (k == 0) {
+                // the run must fit in a header
+                k = MIN(n - i, MAX_REQUEST / asize);
+                need = k * asize;
+                if ((quick_flush_all(), bp = find_fit(need)) == NULL &&
+                        (bp = grow_heap(need)) == NULL)
+                    break;
+            }
+            place_batch(bp, asize, k, ptrs + i);
+            i += k;
+        }
+    }
+
+    // slab objects, and whatever a fragmented heap can still give
+    while (i < n && (ptrs[i] = core_malloc(size)) != NULL)
+        i++;
+    return i;
+}
+
+/*
+ * core_free_batch - free n blocks of the current arena sorted by address
+ * a run of blocks that follow each other in the heap becomes one free block
+ */
+static void core_free_batch(void **ptrs, size_t n)
+{
+    size_t i, j, size;
+    char *bp;
+
+    for (i = 0; i < n; i = j) {
+        bp = ptrs[i];
+        j = i + 1;
+        if (IS_SLAB(bp)) {
+            core_free(bp, 0);
+            continue;
+        }
+        size = GET_SIZE(HDRP(bp));
+        while (j < n && (char *) ptrs[j] == bp + size) {
+            size += GET_SIZE(HDRP(ptrs[j]));
+            j++;
+        }
+        // a block on its own may still be parked
+        if (j == i + 1) {
+            core_free(bp, 0);
+            continue;
+        }
+        // the run counts as j - i frees towards the next purge
+        PUT(PURGE_CLOCK, GET(PURGE_CLOCK) + (j - i));
+        if (GET(PURGE_CLOCK) >= PURGE_INTERVAL)
+            purge(0);
+        PUT(HDRP(bp), PACK(size, 1) | GET_PREV_ALLOC(HDRP(bp)));
+        free_block(bp);
+    }
+}
+
+/*
+ * order block pointers by address
+ */
+static int ptr_cmp(const void *a, const void *b)
+{
+    char *p = *(char * const *) a;
+    char *q = *(char * const *) b;
+    return (p > q) - (p < q);
+}
+
+/*
+ * core_realloc - only free and malloc when necessary
+ * coalescing strategy is used when expanding the block size
+ */
+static void *core_realloc(void *bp, size_t size)
+{
+    // bp is NULL, equivalent to malloc call
+    if (bp == NULL) {
+       return core_malloc(size);
+    }
+
+    // size is 0, equivalent to free
+    if (size == 0) {
+        core_free(bp, 0);
+        return NULL;
+    }
+
+    // the block is left untouched if the request cannot be served
+    if (size > MAX_REQUEST)
+        return NULL;
+
+    size_t old_size, asize, grow_size, nextblc_size, prevblc_size, total_size, copy_size;
+    void *oldbp = bp;
+    void *newbp;
+    char *nextbp;
+
+    // a slab object stays in place while the request fits its slot,
+    // otherwise it moves to wherever malloc puts the new size
+    if (IS_SLAB(bp)) {
+        old_size = GET(SLAB_OBJ_SIZE(SLAB_OF(bp)));
+        if (size <= old_size)
+            return bp;
+        if ((newbp = core_malloc(size)) == NULL)
+            return NULL;
+        memcpy(newbp, bp, old_size);
+        slab_free(bp);
+        return newbp;
+    }
+
+    old_size = GET_SIZE(HDRP(bp));
+
+    // check whether realloc is shrinking or expanding
+    // get the adjusted size of the request
+    if (size <= MIN_BLOCK_SIZE - WSIZE) {
+        asize = MIN_BLOCK_SIZE;
+    } else {
+        asize = DSIZE * ((size + WSIZE + (DSIZE-1)) / DSIZE);
+    }
+
+    // if the same size
+    if (asize == old_size) {
+        return bp;
+    }
+    // if shrinking
+    if (asize < old_size) {
+        // a grown block keeps its headroom while the request would have
+        // been given that much anyway, otherwise it is cut back to size
+        if ((GET(HDRP(bp)) & GROWN) && GROW_SIZE(asize) >= old_size)
+            return bp;
+        // we split the block if the remainder is big enough
+        if (old_size - asize >= MIN_BLOCK_SIZE) {
+            // shrink the old block
+            PUT(HDRP(bp), PACK(asize, 1) | GET_PREV_ALLOC(HDRP(bp)));
+            // construct the new block
+            newbp = NEXT_BLKP(bp);
+            PUT(HDRP(newbp), PACK(old_size - asize, 0) | PREV_ALLOC);
+            PUT(FTRP(newbp), PACK(old_size - asize, 0));
+            CLR_PREV_ALLOC(HDRP(NEXT_BLKP(newbp)));
+            // merge it with a free right neighbour so that no two free
+            // blocks are adjacent, then insert it into free list
+            insert(coalesce(newbp));
+        }
+        // otherwise we don't do anything
+        return oldbp;
+    }
+
+    // if expanding
+    else {
+        // a block grown before is likely to grow again, so it gets
+        // headroom wherever it would otherwise be moved or merged
+        grow_size = asize;
+        if ((GET(HDRP(bp)) & GROWN) && GROW_SIZE(asize) <= MAX_REQUEST)
+            grow_size = GROW_SIZE(asize);
+
+        // we check if we can make the block large enough by
+        // coalescing with the block to its right
+        nextblc_size = GET_ALLOC(HDRP(NEXT_BLKP(bp))) ? 0 : GET_SIZE(HDRP(NEXT_BLKP(bp)));
+        if (nextblc_size + old_size >= asize) {
+            // we coalesce
+            // first, delete the next block from free list
+            delete(NEXT_BLKP(bp));
+            // then we construct a large allocated block, giving back
+            // the part of the next block we don't need if it is big enough
+            total_size = old_size + nextblc_size;
+            grow_size = MIN(grow_size, total_size);
+            if (total_size - grow_size >= MIN_BLOCK_SIZE) {
+                PUT(HDRP(bp), PACK(grow_size, 1) | GROWN | GET_PREV_ALLOC(HDRP(bp)));
+                newbp = NEXT_BLKP(bp);
+                PUT(HDRP(newbp), PACK(total_size - grow_size, 0) | PREV_ALLOC);
+                PUT(FTRP(newbp), PACK(total_size - grow_size, 0));
+                insert(newbp);
+            } else {
+                PUT(HDRP(bp), PACK(total_size, 1) | GROWN | GET_PREV_ALLOC(HDRP(bp)));
+                SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+            }
+            zero_claim(bp);
+            return oldbp;
+        }
+
+        // next, a free block to the left together with the right one
+        // may be large enough; the payload then moves down in place
+        prevblc_size = GET_PREV_ALLOC(HDRP(bp)) ? 0 : GET_SIZE(HDRP(PREV_BLKP(bp)));
+        if (prevblc_size + old_size + nextblc_size >= asize) {
+            newbp = PREV_BLKP(bp);
+            delete(newbp);
+            // the right block is only taken when the left one is not enough
+            if (prevblc_size + old_size >= grow_size) {
+                nextblc_size = 0;
+            } else if (nextblc_size) {
+                delete(NEXT_BLKP(bp));
+            }
+            total_size = prevblc_size + old_size + nextblc_size;
+            grow_size = MIN(grow_size, total_size);
+            PUT(HDRP(newbp), PACK(total_size, 1) | GROWN | GET_PREV_ALLOC(HDRP(newbp)));
+            memmove(newbp, oldbp, old_size - WSIZE);
+
+            if (total_size - grow_size >= MIN_BLOCK_SIZE) {
+                PUT(HDRP(newbp), PACK(grow_size, 1) | GROWN | GET_PREV_ALLOC(HDRP(newbp)));
+                bp = NEXT_BLKP(newbp);
+                PUT(HDRP(bp), PACK(total_size - grow_size, 0) | PREV_ALLOC);
+                PUT(FTRP(bp), PACK(total_size - grow_size, 0));
+                CLR_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+                // the right block may still be free and adjacent
+                insert(coalesce(bp));
+            } else {
+                SET_PREV_ALLOC(HDRP(NEXT_BLKP(newbp)));
+            }
+            zero_claim(newbp);
+            return newbp;
+        }
+
+        // the last block of the heap grows by sbrk-ing just the deficit,
+        // taking a free block between it and the epilogue along; it can
+        // always grow this way again, so it gets no headroom
+        nextbp = nextblc_size ? NEXT_BLKP(NEXT_BLKP(bp)) : NEXT_BLKP(bp);
+        if (GET_SIZE(HDRP(nextbp)) == 0
+                && mem_region_sbrk(cur_arena, asize - old_size - nextblc_size) != (void *) -1) {
+            if (nextblc_size)
+                delete(NEXT_BLKP(bp));
+            PUT(HDRP(bp), PACK(asize, 1) | GROWN | GET_PREV_ALLOC(HDRP(bp)));
+            PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1) | PREV_ALLOC); // new epilogue
+            zero_claim(bp);
+            return oldbp;
+        }
+
+        // in all other cases, we free the current block and allocate
+        // a new block and copy everything over; a huge block moves to a
+        // mapping, where it can grow by remapping from then on
+        if (size >= MMAP_THRESHOLD)
+            newbp = map_alloc(size);
+        else
+            newbp = core_malloc(grow_size > asize ? grow_size - WSIZE : size);
+        if (newbp == NULL)
+            return NULL;
+        if (!IS_MAPPED(newbp) && !IS_SLAB(newbp))
+            PUT(HDRP(newbp), GET(HDRP(newbp)) | GROWN);
+        copy_size = old_size - WSIZE;
+        memcpy(newbp, oldbp, copy_size);
+        core_free(bp, 0);
+        return newbp;
+    }
+}
+
+/*
+ * allocate a block as a mapping of its own, rounded up to whole pages
+ */
+static void *map_alloc(size_t size) {
+    size_t page = mem_pagesize();
+    size_t msize;
+    char *map;
+
+    if (size > MAX_REQUEST)
+        return NULL;
+    msize = (size + DSIZE + page - 1) & ~(page - 1);
+    if ((map = mem_map(msize)) == (void *) -1)
+        return NULL;
+    PUT(map + WSIZE, PACK(msize, 1));
+    return map + DSIZE;
+}
+
+/*
+ * give a mapped block back to memlib at once
+ */
+static void map_free(void *bp) {
+    mem_unmap((char *) bp - DSIZE, GET_SIZE(HDRP(bp)));
+}
+
+/*
+ * resize a mapped block by remapping it, which moves no data even if the
+ * mapping has to move; a block that shrinks below MMAP_THRESHOLD goes
+ * back to the heap
+ */
+static void *map_realloc(void *bp, size_t size) {
+    size_t page = mem_pagesize();
+    size_t old_size = GET_SIZE(HDRP(bp));
+    size_t msize;
+    char *map, *newbp;
+
+    if (size == 0) {
+        map_free(bp);
+        return NULL;
+    }
+    if (size > MAX_REQUEST)
+        return NULL;
+
+    if (size < MMAP_THRESHOLD) {
+        if ((newbp = mm_malloc(size)) == NULL)
+            return NULL;
+        memcpy(newbp, bp, size);
+        map_free(bp);
+        return newbp;
+    }
+
+    msize = (size + DSIZE + page - 1) & ~(page - 1);
+    if (msize == old_size)
+        return bp;
+    if ((map = mem_remap((char *) bp - DSIZE, old_size, msize)) == (void *) -1)
+        return NULL;
+    PUT(map + WSIZE, PACK(msize, 1));
+    return map + DSIZE;
+}
+
+/*
+ * free_block - mark an allocated block free, coalesce it and index it
+ */
+static void free_block(void *bp) {
+    size_t size = GET_SIZE(HDRP(bp));
+    PUT(HDRP(bp), PACK(size, 0) | GET_PREV_ALLOC(HDRP(bp)));
+    PUT(FTRP(bp), PACK(size, 0));
+    CLR_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+    insert(coalesce(bp));
+}
+
+/*
+ * free all blocks parked in the quick list at head
+ */
+static void quick_flush(char *head) {
+    char *bp = GET_PTR(head);
+    char *next;
+
+    PUT(head, 0);
+    for (; bp != NULL; bp = next) {
+        next = GET_PTR(QUICK_NEXT(bp));
+        free_block(bp);
+    }
+}
+
+/*
+ * free the blocks parked in every quick list of the current arena
+ */
+static void quick_flush_all(void) {
+    size_t asize;
+
+    for (asize = SLAB_MAX_SIZE + DSIZE; asize <= QUICK_MAX_SIZE; asize += DSIZE)
+        if (GET(QUICK_HEAD(asize)))
+            quick_flush(QUICK_HEAD(asize));
+}
+
+/*
+ * give free memory of the current arena back to memlib: a free block
+ * ending the heap is cut down to CHUNKSIZE by shrinking the heap, and the
+ * whole pages inside any other free block are released, for blocks of at
+ * least TRIM_THRESHOLD bytes that were free at the last purge already,
+ * or for all of them if now is set
+ */
+static void purge(int now) {
+    char *bp = (char *) mem_region_hi(cur_arena) + 1; // past the epilogue
+    size_t size;
+
+    PUT(PURGE_CLOCK, 0);
+
+    // parked blocks may hold the end of the heap or split a large free block
+    if (now)
+        quick_flush_all();
+
+    if (!GET_PREV_ALLOC(HDRP(bp))) {
+        bp = PREV_BLKP(bp);
+        size = GET_SIZE(HDRP(bp));
+        if (size >= TRIM_THRESHOLD && (now || (GET(HDRP(bp)) & AGED))) {
+            delete(bp);
+            PUT(HDRP(bp), PACK(CHUNKSIZE, 0) | GET_PREV_ALLOC(HDRP(bp)));
+            PUT(FTRP(bp), PACK(CHUNKSIZE, 0));
+            PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); // new epilogue
+            mem_region_sbrk(cur_arena, -(long) (size - CHUNKSIZE));
+            if (GET(ZERO_FROM) >= TO_OFFSET(FTRP(bp)))
+                PUT(ZERO_FROM, 0);
+            insert(bp);
+        }
+    }
+
+    // everything else stays where it is in the index
+    purge_index(now);
+}
+
+/*
+ * release the pages inside a large free block if it has aged, otherwise
+ * mark it so that the next purge releases them
+ * coalescing or allocating rewrites the header and so resets the age
+ */
+static void purge_block(char *bp, int now) {
+    if (GET_SIZE(HDRP(bp)) < TRIM_THRESHOLD)
+        return;
+    if (now || (GET(HDRP(bp)) & AGED))
+        mem_release(bp + DSIZE, GET_SIZE(HDRP(bp)) - 2*DSIZE);
+    else
+        PUT(HDRP(bp), GET(HDRP(bp)) | AGED);
+}
+
+/*
+ * Extend the heap by a given number of words
+ */
+static void *extend_heap(size_t words) {
+    char *bp, *p, *zero, *z;
+    size_t size; // in bytes
+
+    // allocate an even number of words to maintain double-word alignment
+    size = (words % 2) ? (words+1) * WSIZE : words * WSIZE;
+    zero = mem_region_zero(cur_arena);
+    if ((bp = mem_region_sbrk(cur_arena, size)) == (void *) -1)
+        return NULL; // extension failed
+    p = bp;
+
+    // extension successful, bp now points to the first byte after allocated space
+    // initialize free block header/footer and epilogue header
+    // the old epilogue header becomes the new block header and keeps its prev allocated bit
+    // pred/succ are handled by insert call below
+    PUT(HDRP(bp), PACK(size, 0) | GET_PREV_ALLOC(HDRP(bp))); // must populate header first
+    PUT(FTRP(bp), PACK(size, 0)); // footer uses header size info
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); // new epilogue, previous block is free
 
     // coalesce if previous block was free
     bp = coalesce(bp);
+    // merged with a free block, the new space extends that block's zero
+    // part once the old footer and epilogue are cleared, which comes
+    // before insert as they may lie among the links of a small block
+    if (bp != p && zero <= p) {
+        PUT(p - DSIZE, 0);
+        PUT(p - WSIZE, 0);
+    }
     // insert the block into the segregated list
     insert(bp);
 
+    // the new space reads as zero unless the region held data there before
+    if (zero > p) {
+        z = zero;
+    } else if (bp == p) {
+        z = p + LINK_BYTES;
+    } else {
+        z = GET_PTR(ZERO_FROM);
+        if (z == NULL || z < bp || z >= p)
+            z = p - DSIZE;
+    }
+    z = MAX(z, bp + LINK_BYTES);
+    PUT(ZERO_FROM, z < FTRP(bp) ? TO_OFFSET(z) : 0);
+
     // mm_check();
     return bp;
 }
 
+/*
+ * note that allocated block bp has been handed out, so that the part of
+ * the free block ending the heap known to read as zero starts after it
+ */
+static void zero_claim(char *bp) {
+    char *next = NEXT_BLKP(bp);
+    char *z = GET_PTR(ZERO_FROM);
+
+    if (z == NULL || z >= next + LINK_BYTES)
+        return;
+    if (!GET_ALLOC(HDRP(next)) && next + LINK_BYTES < FTRP(next))
+        PUT(ZERO_FROM, TO_OFFSET(next + LINK_BYTES));
+    else
+        PUT(ZERO_FROM, 0);
+}
+
 
 /*
  * Coalesce a free block with ajacent free blocks to form a larger free block
+ * the block after bp must already have its prev allocated bit cleared
  */
 static void *coalesce(void *bp) {
-    size_t prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
+    size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
     size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
     size_t size = GET_SIZE(HDRP(bp));
 
@@ -428,7 +1899,7 @@ static void *coalesce(void *bp) {
         delete(NEXT_BLKP(bp));
         // then, update the size information
         size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
-        PUT(HDRP(bp), PACK(size, 0));
+        PUT(HDRP(bp), PACK(size, 0) | PREV_ALLOC);
         PUT(FTRP(bp), PACK(size, 0));
     }
 
@@ -439,7 +1910,7 @@ static void *coalesce(void *bp) {
         // then, update the size information
         size += GET_SIZE(HDRP(PREV_BLKP(bp)));
         PUT(FTRP(bp), PACK(size, 0));
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
+        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0) | PREV_ALLOC);
         bp = PREV_BLKP(bp);
     }
 
@@ -450,7 +1921,7 @@ static void *coalesce(void *bp) {
         delete(NEXT_BLKP(bp));
         // then, update the size information
         size += GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(FTRP(NEXT_BLKP(bp)));
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
+        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0) | PREV_ALLOC);
         PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
         bp = PREV_BLKP(bp);
     }
@@ -460,44 +1931,524 @@ static void *coalesce(void *bp) {
 
 
 /*
- * find first free block that fit the size of request
+ * take a free object of a slab class, creating a slab if none has one
+ */
+static void *slab_alloc(int slab_class) {
+    char *s = GET_PTR(SLAB_HEAD(slab_class));
+    char *map;
+    unsigned int bits;
+    int i;
+
+    if (s == NULL && (s = slab_create(slab_class)) == NULL)
+        return NULL;
+
+    // the head slab has a free slot, find the first set bit
+    for (i = 0, map = SLAB_BITMAP(s); (bits = GET(map)) == 0; i += 32, map += WSIZE)
+        ;
+    i += __builtin_ctz(bits);
+    PUT(map, bits & (bits - 1));
+
+    // a full slab leaves the list until one of its objects is freed
+    PUT(SLAB_NFREE(s), GET(SLAB_NFREE(s)) - 1);
+    if (GET(SLAB_NFREE(s)) == 0)
+        slab_unlink(s, slab_class);
+
+    return s + GET(SLAB_FIRST(s)) + i * GET(SLAB_OBJ_SIZE(s));
+}
+
+/*
+ * return an object to its slab
+ * an empty slab goes back to the block heap unless it is the only slab
+ * of its class with free slots, so alternating malloc/free of one object
+ * does not create and destroy a slab every time
+ */
+static void slab_free(void *p) {
+    char *s = SLAB_OF(p);
+    unsigned int size = GET(SLAB_OBJ_SIZE(s));
+    unsigned int i = ((char *) p - s - GET(SLAB_FIRST(s))) / size;
+    int slab_class = size / DSIZE - 1;
+    char *map = SLAB_BITMAP(s) + WSIZE*(i / 32);
+
+    PUT(map, GET(map) | (1U << (i % 32)));
+    PUT(SLAB_NFREE(s), GET(SLAB_NFREE(s)) + 1);
+
+    if (GET(SLAB_NFREE(s)) == 1) {
+        slab_link(s, slab_class);
+    } else if (GET(SLAB_NFREE(s)) == GET(SLAB_NOBJ(s))
+            && (GET(SLAB_PREV(s)) != 0 || GET(SLAB_NEXT(s)) != 0)) {
+        slab_unlink(s, slab_class);
+        PUT(SLAB_MAP(s), GET(SLAB_MAP(s)) & ~SLAB_BIT(s));
+        core_free(s, 0);
+    }
+}
+
+/*
+ * carve a slab for a class out of the free block at the end of the heap,
+ * extending the heap by whatever that block lacks
+ * the slab is an allocated block whose payload starts on a SLAB_SIZE
+ * boundary; the free space in front of it and after it stays free
+ */
+static char *slab_create(int slab_class) {
+    char *bp = (char *) mem_region_hi(cur_arena) + 1; // payload position after the epilogue
+    char *s;
+    size_t size = 0, pad, rest, ssize;
+    unsigned int obj_size = (slab_class + 1) * DSIZE;
+    unsigned int nobj, map_bytes;
+
+    // start from the last block if it is free
+    if (!GET_PREV_ALLOC(HDRP(bp))) {
+        bp = PREV_BLKP(bp);
+        size = GET_SIZE(HDRP(bp));
+    }
+
+    // the padding in front of the slab must be empty or a valid free block
+    pad = (SLAB_SIZE - TO_OFFSET(bp) % SLAB_SIZE) % SLAB_SIZE;
+    if (pad > 0 && pad < MIN_BLOCK_SIZE)
+        pad += SLAB_SIZE;
+
+    if (size < pad + SLAB_SIZE) {
+        if ((bp = extend_heap((pad + SLAB_SIZE - size) / WSIZE)) == NULL)
+            return NULL;
+        size = GET_SIZE(HDRP(bp));
+    }
+    delete(bp);
+
+    // a remainder too small to be a block stays in the slab block
+    rest = size - pad - SLAB_SIZE;
+    ssize = SLAB_SIZE;
+    if (rest < MIN_BLOCK_SIZE) {
+        ssize += rest;
+        rest = 0;
+    }
+
+    s = bp + pad;
+    if (pad > 0) {
+        PUT(HDRP(bp), PACK(pad, 0) | GET_PREV_ALLOC(HDRP(bp)));
+        PUT(FTRP(bp), PACK(pad, 0));
+        insert(bp);
+        PUT(HDRP(s), PACK(ssize, 1));
+    } else {
+        PUT(HDRP(s), PACK(ssize, 1) | GET_PREV_ALLOC(HDRP(s)));
+    }
+    if (rest > 0) {
+        bp = NEXT_BLKP(s);
+        PUT(HDRP(bp), PACK(rest, 0) | PREV_ALLOC);
+        PUT(FTRP(bp), PACK(rest, 0));
+        insert(bp);
+    } else {
+        SET_PREV_ALLOC(HDRP(NEXT_BLKP(s)));
+    }
+    zero_claim(s);
+
+    // fit as many objects as possible after the descriptor and the bitmap,
+    // leaving the last word of the page to the header of the next block
+    nobj = (SLAB_SIZE - WSIZE - (SLAB_BITMAP(s) - s)) / obj_size;
+    while (ALIGN((nobj + 31) / 32 * WSIZE) + nobj * obj_size
+            > SLAB_SIZE - WSIZE - (SLAB_BITMAP(s) - s))
+        nobj--;
+    map_bytes = (nobj + 31) / 32 * WSIZE;
+
+    PUT(SLAB_OBJ_SIZE(s), obj_size);
+    PUT(SLAB_NOBJ(s), nobj);
+    PUT(SLAB_NFREE(s), nobj);
+    PUT(SLAB_FIRST(s), (SLAB_BITMAP(s) - s) + ALIGN(map_bytes));
+    memset(SLAB_BITMAP(s), 0xff, map_bytes);
+    if (nobj % 32)
+        PUT(SLAB_BITMAP(s) + map_bytes - WSIZE, (1U << (nobj % 32)) - 1);
+
+    PUT(SLAB_MAP(s), GET(SLAB_MAP(s)) | SLAB_BIT(s));
+    if (SLAB_MAP_WORD(s) >= slab_map_top[cur_arena])
+        slab_map_top[cur_arena] = SLAB_MAP_WORD(s) + 1;
+    slab_link(s, slab_class);
+    return s;
+}
+
+/*
+ * push a slab to the front of the list of its class
+ */
+static void slab_link(char *s, int slab_class) {
+    char *head = SLAB_HEAD(slab_class);
+
+    PUT(SLAB_PREV(s), 0);
+    PUT(SLAB_NEXT(s), GET(head));
+    if (GET(head) != 0)
+        PUT(SLAB_PREV(GET_PTR(head)), TO_OFFSET(s));
+    PUT(head, TO_OFFSET(s));
+}
+
+/*
+ * remove a slab from the list of its class
+ */
+static void slab_unlink(char *s, int slab_class) {
+    if (GET(SLAB_PREV(s)) != 0)
+        PUT(SLAB_NEXT(GET_PTR(SLAB_PREV(s))), GET(SLAB_NEXT(s)));
+    else
+        PUT(SLAB_HEAD(slab_class), GET(SLAB_NEXT(s)));
+    if (GET(SLAB_NEXT(s)) != 0)
+        PUT(SLAB_PREV(GET_PTR(SLAB_NEXT(s))), GET(SLAB_PREV(s)));
+}
+
+
+#if MM_THREADS
+
+/*
+ * one-time setup of the arena mutexes and of the key that flushes thread caches
+ */
+static void arena_setup(void) {
+    int k;
+    for (k = 0; k < MEM_REGIONS; k++)
+        pthread_mutex_init(&arena_mutex[k], NULL);
+    pthread_key_create(&tcache_key, tcache_flush);
+}
+
+/*
+ * return the arena of the calling thread, assigning one on the first call
+ */
+static int arena_get(void) {
+    if (thread_arena < 0)
+        thread_arena = __sync_fetch_and_add(&next_arena, 1) % num_arenas;
+    return thread_arena;
+}
+
+/*
+ * take the mutex of arena k and make it the current arena of the thread
+ * returns -1, with the mutex released, if the arena cannot be created
+ */
+static int arena_lock(int k) {
+    pthread_mutex_lock(&arena_mutex[k]);
+    if (arena_use(k) < 0) {
+        pthread_mutex_unlock(&arena_mutex[k]);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * make arena k, whose mutex the thread holds, the current arena,
+ * creating it if its region is still empty and draining its remote frees
+ */
+static int arena_use(int k) {
+    cur_arena = k;
+    freelist_p = ARENA_INDEX(k);
+    heap_listp = ARENA_PROLOGUE(k);
+    if (mem_region_size(k) == 0)
+        return arena_init();
+    if (__atomic_load_n(REMOTE_HEAD(k), __ATOMIC_RELAXED) != 0)
+        remote_drain(k);
+    return 0;
+}
+
+/*
+ * push a block onto the remote-free queue of arena k without its mutex,
+ * draining the queue on the spot if it is long and the mutex is free
+ */
+static void remote_free(int k, void *bp) {
+    unsigned int head = __atomic_load_n(REMOTE_HEAD(k), __ATOMIC_RELAXED);
+
+    do {
+        PUT(bp, head);
+    } while (!__atomic_compare_exchange_n(REMOTE_HEAD(k), &head, TO_OFFSET(bp),
+                1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (__atomic_add_fetch(REMOTE_COUNT(k), 1, __ATOMIC_RELAXED) >= REMOTE_LIMIT
+            && pthread_mutex_trylock(&arena_mutex[k]) == 0) {
+        arena_use(k);
+        UNLOCK();
+    }
+}
+
+/*
+ * detach the remote-free queue of the current arena k and free its blocks
+ * pushes that race with the exchange simply start a new queue
+ */
+static void remote_drain(int k) {
+    unsigned int off = __atomic_exchange_n(REMOTE_HEAD(k), 0, __ATOMIC_ACQUIRE);
+    unsigned int n = 0;
+    char *bp;
+
+    while (off != 0) {
+        bp = heap_base + off;
+        off = GET(bp);
+        core_free(bp, 0);
+        n++;
+    }
+    __atomic_sub_fetch(REMOTE_COUNT(k), n, __ATOMIC_RELAXED);
+}
+
+/*
+ * map a request size to its thread cache class, -1 if it is not cached
+ * requests of a slab class come first, then block sizes up to TCACHE_MAX_SIZE
+ */
+static int tcache_class(size_t size) {
+    size_t asize;
+    if (size == 0)
+        return -1;
+    if (size <= SLAB_MAX_SIZE)
+        return (size - 1) / DSIZE;
+    asize = DSIZE * ((size + WSIZE + (DSIZE-1)) / DSIZE);
+    if (asize > TCACHE_MAX_SIZE)
+        return -1;
+    return SLAB_CLASSES + (asize - SLAB_MAX_SIZE) / DSIZE - 1;
+}
+
+/*
+ * return the cache of the calling thread, allocating it on first use
+ */
+static char *tcache_get(void) {
+    if (tcache_p != NULL && tcache_epoch == heap_epoch)
+        return tcache_p;
+
+    if (LOCK(arena_get()) < 0)
+        return NULL;
+    tcache_p = core_malloc(TCACHE_BYTES);
+    UNLOCK();
+    if (tcache_p == NULL)
+        return NULL;
+    memset(tcache_p, 0, TCACHE_BYTES);
+    tcache_epoch = heap_epoch;
+
+    pthread_setspecific(tcache_key, tcache_p);
+    return tcache_p;
+}
+
+/*
+ * take a block from the cache of the calling thread, refilling an empty
+ * class from the core with a batch of blocks of the largest size it serves
+ */
+static void *tcache_alloc(size_t size) {
+    int i = tcache_class(size);
+    char *cache, *bp;
+    size_t fill_size;
+
+    if (i < 0 || (cache = tcache_get()) == NULL)
+        return NULL;
+
+    if (GET(TCACHE_NUM(cache, i)) == 0) {
+        fill_size = (i < SLAB_CLASSES) ? (i + 1) * DSIZE
+                : SLAB_MAX_SIZE + (i - SLAB_CLASSES + 1) * DSIZE - WSIZE;
+        LOCK(thread_arena);
+        while (GET(TCACHE_NUM(cache, i)) < TCACHE_BATCH
+                && (bp = core_malloc(fill_size)) != NULL) {
+            PUT(bp, GET(TCACHE_HEAD(cache, i)));
+            PUT(TCACHE_HEAD(cache, i), TO_OFFSET(bp));
+            PUT(TCACHE_NUM(cache, i), GET(TCACHE_NUM(cache, i)) + 1);
+        }
+        UNLOCK();
+        if (GET(TCACHE_NUM(cache, i)) == 0)
+            return NULL;
+    }
+
+    bp = GET_PTR(TCACHE_HEAD(cache, i));
+    PUT(TCACHE_HEAD(cache, i), GET(bp));
+    PUT(TCACHE_NUM(cache, i), GET(TCACHE_NUM(cache, i)) - 1);
+    return bp;
+}
+
+/*
+ * put a block of the thread's own arena into the cache of the thread,
+ * draining a full class to the arena first; returns 0 if the block is
+ * not cached
+ * the size of a live block does not change, so reading it needs no lock
+ */
+static int tcache_free(void *bp, size_t size) {
+    int i;
+    char *cache;
+
+    if (REGION_OF(bp) != arena_get())
+        return 0;
+    if (size > SLAB_MAX_SIZE) {
+        // the class follows from the size alone
+        if ((i = tcache_class(size)) < 0)
+            return 0;
+    } else if (IS_SLAB(bp)) {
+        i = GET(SLAB_OBJ_SIZE(SLAB_OF(bp))) / DSIZE - 1;
+    } else {
+        size = GET_SIZE(HDRP(bp));
+        if (size <= SLAB_MAX_SIZE || size > TCACHE_MAX_SIZE)
+            return 0;
+        i = SLAB_CLASSES + (size - SLAB_MAX_SIZE) / DSIZE - 1;
+    }
+    if ((cache = tcache_get()) == NULL)
+        return 0;
+
+    if (GET(TCACHE_NUM(cache, i)) == TCACHE_LIMIT)
+        tcache_drain(cache, i, TCACHE_BATCH);
+
+    PUT(bp, GET(TCACHE_HEAD(cache, i)));
+    PUT(TCACHE_HEAD(cache, i), TO_OFFSET(bp));
+    PUT(TCACHE_NUM(cache, i), GET(TCACHE_NUM(cache, i)) + 1);
+    return 1;
+}
+
+/*
+ * give up to n cached blocks of a class back to the core
+ */
+static void tcache_drain(char *cache, int i, int n) {
+    char *bp;
+
+    LOCK(thread_arena);
+    while (n-- > 0 && GET(TCACHE_NUM(cache, i)) > 0) {
+        bp = GET_PTR(TCACHE_HEAD(cache, i));
+        PUT(TCACHE_HEAD(cache, i), GET(bp));
+        PUT(TCACHE_NUM(cache, i), GET(TCACHE_NUM(cache, i)) - 1);
+        core_free(bp, 0);
+    }
+    UNLOCK();
+}
+
+/*
+ * drain the whole cache of an exiting thread and free the cache itself
+ */
+static void tcache_flush(void *cache) {
+    int i;
+
+    // a cache of an earlier heap went away with it
+    if (cache == tcache_p && tcache_epoch == heap_epoch) {
+        for (i = 0; i < TCACHE_CLASSES; i++)
+            tcache_drain(cache, i, TCACHE_LIMIT);
+        LOCK(thread_arena);
+        core_free(cache, 0);
+        UNLOCK();
+    }
+    tcache_p = NULL;
+}
+
+#endif
+
+
+#if TLSF
+
+/*
+ * find a free block that fits the size of request in constant time
+ * the request is rounded up to the next second-level range, so the
+ * head of the first non-empty list at or above that range always fits
+ */
+static void *find_fit(size_t asize) {
+    int fl, sl;
+    unsigned int sl_map, fl_map;
+
+    if (FIT_STATS)
+        fit_calls++;
+    mapping_search(asize, &fl, &sl);
+    if (fl >= FL_COUNT)
+        return NULL;
+
+    // first look for a list in the same first level
+    sl_map = GET(SL_BITMAP(fl)) & (~0U << sl);
+    if (!sl_map) {
+        // otherwise take the smallest non-empty higher first level
+        fl_map = (fl + 1 < FL_COUNT) ? GET(FL_BITMAP) & (~0U << (fl + 1)) : 0;
+        if (!fl_map)
+            return NULL; // no fit found
+        fl = __builtin_ctz(fl_map);
+        sl_map = GET(SL_BITMAP(fl));
+    }
+    sl = __builtin_ctz(sl_map);
+
+    if (FIT_STATS)
+        fit_probes++;
+    return GET_PTR(TLSF_HEAD(fl, sl));
+}
+
+/*
+ * hand every block of the lists that may hold TRIM_THRESHOLD bytes or
+ * more to purge_block
+ */
+static void purge_index(int now) {
+    int fl, sl;
+    char *bp;
+
+    mapping_insert(TRIM_THRESHOLD, &fl, &sl);
+    for (; fl < FL_COUNT; fl++, sl = 0)
+        for (; sl < SL_COUNT; sl++)
+            for (bp = GET_PTR(TLSF_HEAD(fl, sl)); bp != NULL; bp = SUCC_BLKP(bp))
+                purge_block(bp, now);
+}
+
+#else
+
+/*
+ * find first free block that fit the size of request, or with FIT_BEST
+ * the smallest one in the first list that has any, or with FIT_NEXT the
+ * first one after the rover of its list
+ * a list whose first FIT_MAX_PROBES blocks do not fit is passed over
+ * falls back to the best fit among the large blocks of the tree
  */
 static void *find_fit(size_t asize) {
     int size_class = get_size_class(asize);    
-    void *class_p, *bp;
-    size_t blk_size;
+    char *head, *start, *bp, *fit;
+    size_t blk_size, fit_size = 0;
+    unsigned int probes;
 
+    if (FIT_STATS)
+        fit_calls++;
     // while fit is not found
-    while (size_class < NUM_SIZE_CLASS) {
-        class_p = freelist_p + size_class;
-
-        // if the current size class is not empty
-        // go through the free list to find a fit
-        if (GET(class_p) != 0) {
-            bp = (void *) GET(class_p);
-            while (bp != ((void *) 0)) {
-                // print_block(bp);
-                blk_size = GET_SIZE(HDRP(bp));
-                if (asize <= blk_size) {
+    while (size_class < NUM_SIZE_CLASS-1) {
+        head = CLASS_HEAD(size_class);
+
+        // go through the free list of the current size class to find a
+        // fit, once around from the sentinel or, with next fit, from the
+        // block after the rover back to the rover
+        start = (FIT_POLICY == FIT_NEXT) ? heap_base + GET(ROVER(size_class)) : head;
+        fit = NULL;
+        probes = 0;
+        for (bp = LIST_SUCC(start); ; bp = LIST_SUCC(bp)) {
+            // print_block(bp);
+            if (bp == head) {
+                if (FIT_POLICY != FIT_NEXT || start == head)
+                    break;
+                continue;
+            }
+            if (FIT_MAX_PROBES > 0 && probes++ == FIT_MAX_PROBES) {
+                // the next search of this list goes on from here
+                if (FIT_POLICY == FIT_NEXT)
+                    PUT(ROVER(size_class), GET(PRED(bp)));
+                break;
+            }
+            if (FIT_STATS)
+                fit_probes++;
+            blk_size = GET_SIZE(HDRP(bp));
+            if (asize <= blk_size) {
+                // delete moves the rover back to the pred of the block
+                if (FIT_POLICY == FIT_NEXT)
+                    PUT(ROVER(size_class), TO_OFFSET(bp));
+                if (FIT_POLICY != FIT_BEST || blk_size == asize)
                     return bp;
+                if (fit == NULL || blk_size < fit_size) {
+                    fit = bp;
+                    fit_size = blk_size;
                 }
-                bp = SUCC_BLKP(bp);
             }
+            if (FIT_POLICY == FIT_NEXT && bp == start)
+                break;
         }
+        if (fit != NULL)
+            return fit;
         // no fit is found in the current list
         size_class++;
     }
 
-    return NULL; // no fit found
+    if (FIT_STATS)
+        fit_probes++;
+    return tree_find_fit(asize);
 }
 
+/*
+ * hand every block of the tree to purge_block, as all blocks of
+ * TRIM_THRESHOLD bytes or more are in it
+ */
+static void purge_index(int now) {
+    tree_purge(GET_PTR(TREE_ROOT), now);
+}
+
+#endif
 
 /*
  * Place a block of certain size at bp, split if necessary
  */
 static void place(void *bp, size_t asize) {
     if (DEBUG_PLACE) {
-        printf("place at %p %d bytes\n", bp, asize);
+        printf("place at %p %zu bytes\n", bp, asize);
     }
 
     size_t csize = GET_SIZE(HDRP(bp));
@@ -507,25 +2458,173 @@ static void place(void *bp, size_t asize) {
         // delete block from free list
         delete(bp);
         // allocate the block
-        PUT(HDRP(bp), PACK(asize, 1));
-        PUT(FTRP(bp), PACK(asize, 1));
+        PUT(HDRP(bp), PACK(asize, 1) | GET_PREV_ALLOC(HDRP(bp)));
         // create new free block from the remainder
         bp = NEXT_BLKP(bp);
-        PUT(HDRP(bp), PACK(csize - asize, 0));
+        PUT(HDRP(bp), PACK(csize - asize, 0) | PREV_ALLOC);
         PUT(FTRP(bp), PACK(csize - asize, 0));
         // insert new block into free list
-        // zero out pred/succ to be safe
-        PUT(PRED(bp), 0);
-        PUT(SUCC(bp), 0);
         insert(bp);
+        zero_claim((char *) bp - asize);
     } else {
         // just allocate the whole block
         delete(bp);
-        PUT(HDRP(bp), PACK(csize, 1));
-        PUT(FTRP(bp), PACK(csize, 1));
+        PUT(HDRP(bp), PACK(csize, 1) | GET_PREV_ALLOC(HDRP(bp)));
+        SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+        zero_claim(bp);
+    }
+}
+
+/*
+ * Place n consecutive blocks of asize bytes at the start of free block bp,
+ * which holds them all, and store them in ptrs; the remainder stays free
+ */
+static void place_batch(char *bp, size_t asize, size_t n, void **ptrs) {
+    size_t csize = GET_SIZE(HDRP(bp));
+    size_t i;
+
+    delete(bp);
+    PUT(HDRP(bp), PACK(asize, 1) | GET_PREV_ALLOC(HDRP(bp)));
+    ptrs[0] = bp;
+    for (i = 1; i < n; i++) {
+        bp += asize;
+        PUT(HDRP(bp), PACK(asize, 1) | PREV_ALLOC);
+        ptrs[i] = bp;
+    }
+    csize -= n * asize;
+
+    if (csize >= MIN_BLOCK_SIZE) {
+        bp += asize;
+        PUT(HDRP(bp), PACK(csize, 0) | PREV_ALLOC);
+        PUT(FTRP(bp), PACK(csize, 0));
+        insert(bp);
+    } else {
+        // the last block takes a remainder too small to be a block
+        PUT(HDRP(bp), PACK(asize + csize, 1) | GET_PREV_ALLOC(HDRP(bp)));
+        SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
     }
+    zero_claim(ptrs[n-1]);
 }
 
+#if TLSF
+
+/*
+ * insert a free block at the head of its TLSF list and mark the list non-empty
+ */
+static void insert(void *bp) {
+    if (DEBUG_INSERT) {
+        printf("before insert");
+        print_block(bp);
+        print_heap();
+        check_list();
+    }
+
+    int fl, sl;
+    char *head;
+    unsigned int bp_off = TO_OFFSET(bp);
+
+    mapping_insert(GET_SIZE(HDRP(bp)), &fl, &sl);
+    head = TLSF_HEAD(fl, sl);
+
+    // the first block of a list has no predecessor
+    PUT(PRED(bp), 0);
+    PUT(SUCC(bp), GET(head));
+    if (GET(head) != 0)
+        PUT(PRED(GET_PTR(head)), bp_off);
+    PUT(head, bp_off);
+
+    PUT(FL_BITMAP, GET(FL_BITMAP) | (1U << fl));
+    PUT(SL_BITMAP(fl), GET(SL_BITMAP(fl)) | (1U << sl));
+
+    if (DEBUG_INSERT) {
+        printf("after insert\n");
+        print_block(bp);
+        print_heap();
+        check_list();
+    }
+}
+
+
+/*
+ * delete a block from its TLSF list, clearing the bitmaps if it empties
+ */
+static void delete(void *bp) {
+    int fl, sl;
+    char *head;
+
+    if (DEBUG_DELETE) {
+        printf("before delete");
+        print_block(bp);
+        print_heap();
+        check_list();
+    }
+
+    if (GET_ALLOC(HDRP(bp))) {
+        printf("calling delete on an allocated block\n");
+        return;
+    }
+
+    if (SUCC_BLKP(bp) != (void *) 0)
+        PUT(PRED(SUCC_BLKP(bp)), GET(PRED(bp)));
+
+    if (PRED_BLKP(bp) != (void *) 0) {
+        PUT(SUCC(PRED_BLKP(bp)), GET(SUCC(bp)));
+    } else {
+        // bp is the first block, its list is found from its size
+        mapping_insert(GET_SIZE(HDRP(bp)), &fl, &sl);
+        head = TLSF_HEAD(fl, sl);
+        PUT(head, GET(SUCC(bp)));
+        if (GET(head) == 0) {
+            PUT(SL_BITMAP(fl), GET(SL_BITMAP(fl)) & ~(1U << sl));
+            if (GET(SL_BITMAP(fl)) == 0)
+                PUT(FL_BITMAP, GET(FL_BITMAP) & ~(1U << fl));
+        }
+    }
+
+    // finally, zero out the pred and succ of bp to be safe
+    PUT(PRED(bp), 0);
+    PUT(SUCC(bp), 0);
+
+    if (DEBUG_DELETE) {
+        printf("after delete");
+        print_block(bp);
+        print_heap();
+        check_list();
+    }
+}
+
+/*
+ * map a block size to the (first level, second level) list holding it
+ * sizes below SMALL_BLOCK_SIZE are spread linearly over the first level
+ */
+static void mapping_insert(size_t asize, int *fl, int *sl) {
+    int msb;
+
+    if (asize < SMALL_BLOCK_SIZE) {
+        *fl = 0;
+        *sl = asize / DSIZE;
+    } else {
+        msb = 31 - __builtin_clz((unsigned int) asize);
+        *fl = msb - FL_SHIFT + 1;
+        *sl = (asize >> (msb - SL_LOG2)) ^ SL_COUNT;
+    }
+}
+
+/*
+ * map a request size to the first list whose blocks are all large enough
+ */
+static void mapping_search(size_t asize, int *fl, int *sl) {
+    int msb;
+
+    if (asize >= SMALL_BLOCK_SIZE) {
+        msb = 31 - __builtin_clz((unsigned int) asize);
+        asize += (1 << (msb - SL_LOG2)) - 1;
+    }
+    mapping_insert(asize, fl, sl);
+}
+
+#else
+
 /*
  * insert a free block at bp into the segregated list
  */
@@ -538,29 +2637,26 @@ static void insert(void *bp) {
     }
 
     size_t size = GET_SIZE(HDRP(bp)); // adjusted size
-    char **size_class_ptr; // the pointer to the address of the first free block of the size class
-    unsigned int bp_val = (unsigned int) bp;
+    char *head; // sentinel of the size class
+    unsigned int bp_off = TO_OFFSET(bp);
 
     // get appropriate size class
-    size_class_ptr = freelist_p + get_size_class(size);
-    // the appropriate size class is empty
-    if (GET(size_class_ptr) == 0) {
-        // change heap array
-        PUT(size_class_ptr, bp_val);
-        // set pred/succ of new free block
-        PUT(PRED(bp), (unsigned int) size_class_ptr);
-        PUT(SUCC(bp), 0);
-    }
-    // the appropriate size class is not empty
-    // insert the free block at the beginning of the size class
+    int size_class = get_size_class(size);
+    head = CLASS_HEAD(size_class);
+    // large blocks go into the tree
+    if (size_class == NUM_SIZE_CLASS-1) {
+        tree_insert(bp);
+    }
+    // or the block goes where its address puts it
+    else if (policy == MM_ADDRESS_ORDER) {
+        skip_insert(bp, size_class);
+    }
+    // otherwise it goes right after the sentinel, empty list or not
     else {
-        // set pred/succ of new free block
-        PUT(PRED(bp), (unsigned int) size_class_ptr);
-        PUT(SUCC(bp), GET(size_class_ptr));
-        // connect the previous head of the size class
-        PUT(PRED(GET(size_class_ptr)), bp_val);
-        // change heap array
-        PUT(size_class_ptr, bp_val);
+        PUT(PRED(bp), TO_OFFSET(head));
+        PUT(SUCC(bp), GET(SUCC(head)));
+        PUT(PRED(LIST_SUCC(head)), bp_off);
+        PUT(SUCC(head), bp_off);
     }
 
     if (DEBUG_INSERT) {
@@ -577,9 +2673,6 @@ static void insert(void *bp) {
  * delete a block from free list
  */
 static void delete(void *bp) {
-    int pre = !is_list_ptr(PRED_BLKP(bp));
-    int suc = (SUCC_BLKP(bp) != (void *) 0);
-
     if (DEBUG_DELETE) {
         printf("before delete");
         print_block(bp);
@@ -592,32 +2685,28 @@ static void delete(void *bp) {
         return;
     }
 
-    // if bp is the first block of a free list and has successors
-    if (!pre && suc) {
-        PUT(PRED_BLKP(bp), (unsigned int) SUCC_BLKP(bp));
-        PUT(PRED(SUCC_BLKP(bp)), (unsigned int) PRED_BLKP(bp));
-    }
+    // an address-ordered list also unlinks the block from its skip levels
+    if (policy == MM_ADDRESS_ORDER && GET_SIZE(HDRP(bp)) <= TREE_MIN_SIZE)
+        skip_delete(bp);
 
-    // if bp is both the first and the last block of a list
-    else if (!pre && !suc) {
-        PUT(PRED_BLKP(bp), (unsigned int) SUCC_BLKP(bp));
+    // large blocks live in the tree
+    if (GET_SIZE(HDRP(bp)) > TREE_MIN_SIZE) {
+        tree_delete(bp);
     }
 
-    // if bp is an intermediate block
-    else if (pre && suc) {
-        PUT(SUCC(PRED_BLKP(bp)), (unsigned int) SUCC_BLKP(bp));
-        PUT(PRED(SUCC_BLKP(bp)), (unsigned int) PRED_BLKP(bp));
-    }
-
-    // if bp is the last block
+    // the neighbours of a block in a circular list always exist, one of
+    // them perhaps the sentinel
     else {
-        PUT(SUCC(PRED_BLKP(bp)), 0);
+        // a search that stopped at the block goes on after its pred
+        if (FIT_POLICY == FIT_NEXT) {
+            char *rover = ROVER(get_size_class(GET_SIZE(HDRP(bp))));
+            if (GET(rover) == TO_OFFSET(bp))
+                PUT(rover, GET(PRED(bp)));
+        }
+        PUT(SUCC(LIST_PRED(bp)), GET(SUCC(bp)));
+        PUT(PRED(LIST_SUCC(bp)), GET(PRED(bp)));
     }
 
-    // finally, zero out the pred and succ of bp to be safe
-    PUT(PRED(bp), 0);
-    PUT(SUCC(bp), 0);
-
     if (DEBUG_DELETE) {
         printf("after delete");
         print_block(bp);
@@ -627,38 +2716,245 @@ static void delete(void *bp) {
 
 }
 
+/*
+ * number of skip levels block bp is on: a hash of its address picks each
+ * next level with odds 1/4, up to as many as the block has room for
+ */
+static int skip_level(char *bp) {
+    unsigned int h = (TO_OFFSET(bp) / DSIZE) * 2654435761U;
+    int room = (GET_SIZE(HDRP(bp)) - MIN_BLOCK_SIZE) / DSIZE;
+    int level = 0;
+
+    while (level < SKIP_LEVELS && level < room && (h >> 30) == 0) {
+        level++;
+        h <<= 2;
+    }
+    return level;
+}
+
+/*
+ * insert free block bp into the address-ordered list of size class i,
+ * after the last block below it, which the skip levels lead to in about
+ * log4(n) steps per level
+ */
+static void skip_insert(char *bp, int i) {
+    char *link[SKIP_LEVELS + 1]; // the word that is to link to bp on each level
+    char *prev = NULL; // the last block below bp found so far
+    char *word, *next;
+    unsigned int bp_off = TO_OFFSET(bp);
+    int l, level = skip_level(bp);
+
+    for (l = SKIP_LEVELS; l > 0; l--) {
+        word = prev ? SKIP_NEXT(prev, l) : SKIP_HEAD(i, l);
+        while ((next = GET_PTR(word)) != NULL && next < bp) {
+            prev = next;
+            word = SKIP_NEXT(prev, l);
+        }
+        link[l] = word;
+    }
+    // the walk of the list itself ends at the sentinel, which follows
+    // the last block
+    if (prev == NULL)
+        prev = CLASS_HEAD(i);
+    while ((next = LIST_SUCC(prev)) != CLASS_HEAD(i) && next < bp)
+        prev = next;
+
+    PUT(PRED(bp), TO_OFFSET(prev));
+    PUT(SUCC(bp), TO_OFFSET(next));
+    PUT(PRED(next), bp_off);
+    PUT(SUCC(prev), bp_off);
+
+    for (l = 1; l <= level; l++) {
+        next = GET_PTR(link[l]);
+        PUT(SKIP_NEXT(bp, l), GET(link[l]));
+        PUT(SKIP_PREV(bp, l), TO_OFFSET(link[l]));
+        if (next != NULL)
+            PUT(SKIP_PREV(next, l), TO_OFFSET(SKIP_NEXT(bp, l)));
+        PUT(link[l], bp_off);
+    }
+}
+
+/*
+ * unlink free block bp from the skip levels of its list
+ */
+static void skip_delete(char *bp) {
+    int l, level = skip_level(bp);
+    char *next;
+
+    for (l = 1; l <= level; l++) {
+        next = GET_PTR(SKIP_NEXT(bp, l));
+        PUT(GET_PTR(SKIP_PREV(bp, l)), GET(SKIP_NEXT(bp, l)));
+        if (next != NULL)
+            PUT(SKIP_PREV(next, l), GET(SKIP_PREV(bp, l)));
+    }
+}
+
 /*
  * get size class based on the adjusted size
  * asize is in bytes
  */
 static int get_size_class(size_t asize) {
-    int size_class = 0;
-    int remainder_sum = 0;
-    while (asize > MIN_BLOCK_SIZE && size_class < NUM_SIZE_CLASS-1) {
-        size_class++;
-        remainder_sum += asize % 2;
-        asize /= 2;
+    if (asize > TREE_MIN_SIZE)
+        return NUM_SIZE_CLASS-1;
+    return size_class_map[(asize + DSIZE-1) / DSIZE];
+}
+
+/*
+ * top-down splay of the subtree rooted at t on the key (size, addr)
+ * returns the new root of the subtree, which is the node with that key
+ * if there is one, and otherwise its predecessor or successor
+ */
+static char *splay(char *t, size_t size, char *addr) {
+    unsigned int l_tree = 0, r_tree = 0; // nodes smaller/greater than the key
+    char *l_slot = (char *) &l_tree; // where the next node of the left tree is linked
+    char *r_slot = (char *) &r_tree; // where the next node of the right tree is linked
+    char *y;
+
+    if (t == NULL)
+        return NULL;
+
+    while (1) {
+        if (KEY_LESS(size, addr, t)) {
+            if ((y = LEFT_BLKP(t)) == NULL)
+                break;
+            if (KEY_LESS(size, addr, y)) {
+                // rotate right
+                PUT(LEFT(t), GET(RIGHT(y)));
+                PUT(RIGHT(y), TO_OFFSET(t));
+                t = y;
+                if (LEFT_BLKP(t) == NULL)
+                    break;
+            }
+            // link t into the right tree
+            PUT(r_slot, TO_OFFSET(t));
+            r_slot = LEFT(t);
+            t = LEFT_BLKP(t);
+        } else if (KEY_GREATER(size, addr, t)) {
+            if ((y = RIGHT_BLKP(t)) == NULL)
+                break;
+            if (KEY_GREATER(size, addr, y)) {
+                // rotate left
+                PUT(RIGHT(t), GET(LEFT(y)));
+                PUT(LEFT(y), TO_OFFSET(t));
+                t = y;
+                if (RIGHT_BLKP(t) == NULL)
+                    break;
+            }
+            // link t into the left tree
+            PUT(l_slot, TO_OFFSET(t));
+            l_slot = RIGHT(t);
+            t = RIGHT_BLKP(t);
+        } else {
+            break;
+        }
     }
-    if (size_class < NUM_SIZE_CLASS-1 && remainder_sum > 0 && asize == MIN_BLOCK_SIZE) {
-        size_class++;
+
+    // reassemble
+    PUT(l_slot, GET(LEFT(t)));
+    PUT(r_slot, GET(RIGHT(t)));
+    PUT(LEFT(t), l_tree);
+    PUT(RIGHT(t), r_tree);
+    return t;
+}
+
+/*
+ * insert a large free block into the tree, it becomes the new root
+ */
+static void tree_insert(void *bp) {
+    size_t size = GET_SIZE(HDRP(bp));
+    char *root = GET_PTR(TREE_ROOT);
+
+    if (root == NULL) {
+        PUT(LEFT(bp), 0);
+        PUT(RIGHT(bp), 0);
+    } else {
+        root = splay(root, size, bp);
+        if (KEY_LESS(size, bp, root)) {
+            PUT(LEFT(bp), GET(LEFT(root)));
+            PUT(RIGHT(bp), TO_OFFSET(root));
+            PUT(LEFT(root), 0);
+        } else {
+            PUT(RIGHT(bp), GET(RIGHT(root)));
+            PUT(LEFT(bp), TO_OFFSET(root));
+            PUT(RIGHT(root), 0);
+        }
     }
-    return size_class;
+    PUT(TREE_ROOT, TO_OFFSET(bp));
 }
 
 /*
- * check whether a pointer points to a free list head
- * allocated on the heap
+ * remove a large free block from the tree
  */
-static int is_list_ptr(void *ptr) {
-    unsigned int ptr_val = (unsigned int) ptr;
-    unsigned int start = (unsigned int) freelist_p;
-    unsigned int end = start + WSIZE*(NUM_SIZE_CLASS-1);
+static void tree_delete(void *bp) {
+    size_t size = GET_SIZE(HDRP(bp));
+    char *x;
 
-    // printf("p: %p, end: %p, start: %p", (void *)ptr_val, (void *)end, (void *)start);
+    // bring bp to the root, then join its subtrees
+    splay(GET_PTR(TREE_ROOT), size, bp);
+    if (LEFT_BLKP(bp) == NULL) {
+        PUT(TREE_ROOT, GET(RIGHT(bp)));
+    } else {
+        // the largest node of the left subtree has no right child
+        x = splay(LEFT_BLKP(bp), size, bp);
+        PUT(RIGHT(x), GET(RIGHT(bp)));
+        PUT(TREE_ROOT, TO_OFFSET(x));
+    }
 
-    if (ptr_val > end || ptr_val < start)
-        return 0;
-    if ((end - ptr_val) % WSIZE)
-        return 0;
-    return 1;
+    PUT(LEFT(bp), 0);
+    PUT(RIGHT(bp), 0);
 }
+
+/*
+ * hand every node of the subtree t to purge_block, in order and without
+ * a stack: the right link of the in-order predecessor of a node is
+ * pointed at the node on the way down and cleared on the way back
+ */
+static void tree_purge(char *t, int now) {
+    char *pred;
+
+    while (t != NULL) {
+        if (LEFT_BLKP(t) == NULL) {
+            purge_block(t, now);
+            t = RIGHT_BLKP(t);
+            continue;
+        }
+        for (pred = LEFT_BLKP(t); RIGHT_BLKP(pred) != NULL && RIGHT_BLKP(pred) != t;
+                pred = RIGHT_BLKP(pred))
+            ;
+        if (RIGHT_BLKP(pred) == NULL) {
+            PUT(RIGHT(pred), TO_OFFSET(t));
+            t = LEFT_BLKP(t);
+        } else {
+            PUT(RIGHT(pred), 0);
+            purge_block(t, now);
+            t = RIGHT_BLKP(t);
+        }
+    }
+}
+
+/*
+ * find the smallest large free block of at least asize bytes (best fit)
+ */
+static void *tree_find_fit(size_t asize) {
+    char *root = GET_PTR(TREE_ROOT);
+    char *succ;
+
+    if (root == NULL)
+        return NULL;
+
+    // no node has the key (asize, NULL), so the root ends up being
+    // either the best fit or the largest block smaller than asize
+    root = splay(root, asize, NULL);
+    PUT(TREE_ROOT, TO_OFFSET(root));
+    if (GET_SIZE(HDRP(root)) >= asize)
+        return root;
+    if (RIGHT_BLKP(root) == NULL)
+        return NULL; // no fit found
+
+    // otherwise the best fit is the smallest node of the right subtree
+    succ = splay(RIGHT_BLKP(root), asize, NULL);
+    PUT(RIGHT(root), TO_OFFSET(succ));
+    return succ;
+}
+
+#endif
@@ -2,8 +2,23 @@
 
 extern int mm_init (void);
 extern void *mm_malloc (size_t size);
+extern void *mm_calloc(size_t nmemb, size_t size);
 extern void mm_free (void *ptr);
+extern void mm_free_sized(void *ptr, size_t size);
 extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_memalign(size_t align, size_t size);
+extern void *mm_aligned_alloc(size_t align, size_t size);
+extern size_t mm_usable_size(void *ptr);
+extern size_t mm_good_size(size_t size);
+extern void mm_trim(void);
+
+/* free-list orders for mm_set_policy, which takes effect at mm_init */
+#define MM_LIFO 0
+#define MM_ADDRESS_ORDER 1
+extern void mm_set_policy(int policy);
+extern int mm_fit_stats(unsigned long *calls, unsigned long *probes);
+extern size_t mm_malloc_batch(size_t size, size_t n, void **ptrs);
+extern void mm_free_batch(void **ptrs, size_t n);
 
 
 /* 